@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "instruction.hpp"
+#include "jit.hpp"
+
+namespace Emulator {
+	class BlockCache {
+	public:
+		struct Block {
+			std::vector<Instruction::Op> ops;
+			Jit::code_t native = nullptr;
+			uint64_t addr = 0;
+			uint32_t hits = 0;
+		};
+
+	private:
+		static constexpr uint64_t PAGE_SIZE = 4096;
+		static constexpr uint64_t MAX_OPS = 64;
+		static constexpr uint64_t MAX_BLOCKS = 0x10000;
+
+		std::unordered_map<uint64_t, Block> blocks;
+		std::unordered_map<uint64_t, std::vector<uint64_t>> page_blocks;
+		std::vector<uint64_t> pending_pages;
+		std::vector<uint8_t> code_pages;
+		uint64_t code_base = 0;
+
+		Jit jit;
+
+		// Slots of translated exits waiting for their target
+		std::map<uint64_t, std::vector<uint64_t*>> links;
+
+		bool flush_pending = false;
+		bool stale = false;
+
+		Block *build(uint64_t addr);
+		void apply(void);
+
+	public:
+		explicit inline BlockCache(void) = default;
+
+		inline bool is_stale(void) const
+		{
+			return stale;
+		}
+
+		inline void flush(void)
+		{
+			flush_pending = true;
+			stale = true;
+		}
+
+		// Only sees the stores of its own hart, see
+		// Bus::invalidate for the other writers
+		inline void invalidate(uint64_t addr)
+		{
+			uint64_t page = (addr - code_base) / PAGE_SIZE;
+
+			if (page >= code_pages.size() || !code_pages[page])
+				return;
+
+			code_pages[page] = 0;
+			pending_pages.push_back(page);
+			stale = true;
+		}
+
+		Block *lookup(uint64_t addr);
+		void compile(Block& block);
+	};
+};
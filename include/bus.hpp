@@ -2,27 +2,39 @@
 
 #include <array>
 #include <memory>
+#include <mutex>
+#include <vector>
 #include "cpu.hpp"
 #include "device.hpp"
+#include "dram.hpp"
+#include "reservation.hpp"
+#include "wakeup.hpp"
 
 namespace Emulator {
 	template<typename T>
 	concept InheritedDevice = std::is_base_of<Device, T>::value;
 		
-	enum class DeviceName : size_t {
-		CLINT = 0,
-		DRAM,
-		GPU,
-		PLIC,
-		SYSCON,
-		VIRTIO,
-
-		SIZE
-	};
-	
 	class Bus {
 	public:
-		explicit constexpr inline Bus(void) = default;
+		ReservationTable reservations;
+		WakeupTable wakeups;
+
+		explicit inline Bus(void) = default;
+
+		// Devices may run threads of their own that use
+		// the bus, stop them all while it is still whole
+		inline ~Bus(void)
+		{
+			for (std::unique_ptr<Device>& device : devices)
+				if (device)
+					device->stop();
+
+			dram = nullptr;
+			regions.clear();
+
+			for (auto it = devices.rbegin(); it != devices.rend(); it++)
+				it->reset();
+		}
 	
 		template<InheritedDevice T, DeviceName N, typename... Args>
 		inline void add(Args&&... args)
@@ -31,6 +43,8 @@ namespace Emulator {
 				std::make_unique<T>(
 					std::forward<Args>(args)...
 				);
+
+			map();
 		}		
 		
 		inline Device *get(DeviceName name) const
@@ -40,7 +54,59 @@ namespace Emulator {
 			return devices[index].get();
 		}
 	
+		inline bool is_dram(const Device *device) const
+		{
+			return device == dram;
+		}
+
+		// For callers that reach into a device directly
+		inline std::unique_lock<std::recursive_mutex> lock(void)
+		{
+			return std::unique_lock(mmio);
+		}
+
+		// Width known at compile time, only MMIO takes the
+		// runtime-width path of the device
+		template<uint64_t N>
+		inline uint64_t load(uint64_t addr)
+		{
+			if (dram && addr - dram->base < dram->size)
+				return dram->load<N>(addr);
+
+			return load(addr, N);
+		}
+
+		template<uint64_t N>
+		inline void store(uint64_t addr, uint64_t value)
+		{
+			if (dram && addr - dram->base < dram->size) {
+				dram->store<N>(addr, value);
+				invalidate(addr);
+				return;
+			}
+
+			store(addr, value, N);
+		}
+
+		// Guest memory copies for DMA, false when the range is
+		// not backed by a single device. DRAM is a plain memcpy
+		bool read_span(uint64_t addr, void *dst, uint64_t len);
+		bool write_span(uint64_t addr, const void *src, uint64_t len);
+
+		// Host memory behind a guest range, nullptr unless all
+		// of it is DRAM. Writers through it call invalidate()
+		inline uint8_t *host(uint64_t addr, uint64_t len)
+		{
+			if (dram && dram->contains(addr, len))
+				return dram->host(addr);
+
+			return nullptr;
+		}
+
+		void invalidate(uint64_t addr, uint64_t len);
+
 		Device *get(uint64_t addr) const;
+		void tick(DeviceName name);
 		uint64_t load(uint64_t addr, uint64_t len);
 		void store(uint64_t addr, uint64_t value, uint64_t len);	
 		void dump(void) const;
@@ -50,7 +116,24 @@ namespace Emulator {
 			std::unique_ptr<Device>, 
 			static_cast<uint64_t>(DeviceName::SIZE)
 		> devices;
+
+		struct Region {
+			uint64_t base;
+			uint64_t end;
+			Device *device;
+		};
+
+		// Address map sorted by base, DRAM is checked before it
+		std::vector<Region> regions;
+		Dram *dram = nullptr;
+
+		void map(void);
+		void invalidate(uint64_t addr);
+
+		// Serializes every hart's accesses to the devices
+		// other than DRAM, which are not thread-safe
+		std::recursive_mutex mmio;
 	};
 
-	extern std::unique_ptr<Bus> bus;
+	extern thread_local Bus *bus;
 };
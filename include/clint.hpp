@@ -1,29 +1,72 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include "device.hpp"
+#include "settings.hpp"
 
 namespace Emulator {
 	class Clint : public Device {
 	private:
-		uint32_t msip = 0;
+		std::array<uint32_t, MAX_HARTS> msip{};
 		static constexpr uint64_t MSIP_BASE = 0x02000000ULL;
 		static constexpr uint64_t MSIP_SIZE = 4;
 
-		uint64_t mtimecmp = 0;
+		std::array<uint64_t, MAX_HARTS> mtimecmp{};
 		static constexpr uint64_t MTIMECMP_BASE = 0x02004000ULL;
 		static constexpr uint64_t MTIMECMP_SIZE = 8;
 
 		uint64_t mtime = 0;
 		static constexpr uint64_t MTIME_BASE = 0x0200bff8ULL;
 		static constexpr uint64_t MTIME_SIZE = 8;
+
+		static constexpr uint64_t TICK_PERIOD = 0x1000;
+
+		// Virtual time: each hart counts its own retired instructions
+		// and catches up with mtime whenever it falls behind
+		const uint64_t harts;
+		const uint64_t icount;
+		std::array<uint64_t, MAX_HARTS> offset{};
+		uint64_t sleeping = 0;
+		uint64_t armed = 0;
+
+		// MSIP and MTIP of every hart, one bit each, read by
+		// the target hart itself without taking the bus lock
+		std::atomic<uint64_t> software = 0;
+		std::atomic<uint64_t> timer = 0;
+
+		void publish(uint64_t hartid);
 	
 	public:
-		explicit inline Clint(void) : 
-			Device(0x02000000ULL, 0x010000ULL) {};
+		static constexpr uint64_t WALL_CLOCK = ~0ULL;
+
+		explicit inline Clint(uint64_t _harts = 1, uint64_t _icount = WALL_CLOCK) : 
+			Device(0x02000000ULL, 0x010000ULL), 
+			harts(_harts), icount(_icount) {};
+
+		inline bool is_virtual(void) const
+		{
+			return icount != WALL_CLOCK;
+		}
+
+		inline bool is_software(uint64_t hartid) const
+		{
+			return (software.load(std::memory_order_relaxed) >> hartid) & 1;
+		}
+
+		inline bool is_timer(uint64_t hartid) const
+		{
+			return (timer.load(std::memory_order_relaxed) >> hartid) & 1;
+		}
+
+		// Marks the hart as in WFI, true if that made every hart idle
+		// and mtime was warped to the nearest armed mtimecmp
+		bool idle(uint64_t hartid, bool timer);
+		void resume(uint64_t hartid);
 		
 		uint64_t load(uint64_t addr, uint64_t len) override;
 		void store(uint64_t addr, uint64_t value, uint64_t len) override;
 		void dump(void) const override;
-		void tick(void);
+		void tick(void) override;
 	};
 };
@@ -3,6 +3,7 @@
 #include <fstream>
 #include <cstdint>
 #include <chrono>
+#include <vector>
 
 namespace Emulator {
 	enum MemSize {
@@ -24,6 +25,16 @@ namespace Emulator {
 		}
 	}
 	
+	// Unsigned type of an N-bit memory access
+	template<uint64_t N> struct Width;
+	template<> struct Width<8> { using type = uint8_t; };
+	template<> struct Width<16> { using type = uint16_t; };
+	template<> struct Width<32> { using type = uint32_t; };
+	template<> struct Width<64> { using type = uint64_t; };
+
+	template<uint64_t N>
+	using uint_t = typename Width<N>::type;
+
 	template<typename T, typename Q>
 	constexpr inline auto SCAST(Q value)
 	{
@@ -1,11 +1,13 @@
 #pragma once
 
 #include <string_view>
-#include <set>
+#include <array>
 #include "settings.hpp"
 #include "registers.hpp"
 #include "interrupt.hpp"
 #include "exception.hpp"
+#include "block.hpp"
+#include "scheduler.hpp"
 #include "bus.hpp"
 
 namespace Emulator {
@@ -37,6 +39,8 @@ namespace Emulator {
 			};
 		};
 
+		const uint64_t hartid;
+
 		Interrupt interrupt;
         Exception exception;
 
@@ -44,9 +48,16 @@ namespace Emulator {
         FRegs flt_regs;
         CRegs csr_regs;
         uint64_t pc;
+
+		BlockCache block_cache;
+		Scheduler scheduler;
+
+		struct Stats {
+			std::array<uint64_t, Instruction::Fusion::SIZE> fused{};
+		} stats;
 		
-		std::set<uint64_t> reservations;
         bool sleep = false;
+		uint64_t mtimecmp = 0;
 		uint64_t mode;
 
 		inline void set_exception(Exception::ExceptionValue type, uint64_t data = 0)
@@ -61,15 +72,23 @@ namespace Emulator {
 			exception.value = 0;
 		}
 				
-		explicit inline Cpu(void) : 
-			mode(Mode::MACHINE), pc(DRAM_BASE) {};
+		explicit inline Cpu(uint64_t _hartid = 0) : 
+			hartid(_hartid), scheduler(_hartid), 
+			mode(Mode::MACHINE), pc(DRAM_BASE)
+		{
+			csr_regs.store(CRegs::Address::MHARTID, hartid);
+		}
 		
 		void iterate(void);
 		void dump_regs(void);
+		void dump_stats(void);
 	
 	private:
 		uint32_t _iterate(void);
+		void execute_block(BlockCache::Block& block);
+		void idle(void);
+		void handle_exception(void);
 	};
 
-	extern std::unique_ptr<Cpu> cpu;
+	extern thread_local Cpu *cpu;
 };
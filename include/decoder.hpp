@@ -183,6 +183,13 @@ namespace Emulator {
 			};
 		};
 		
+		struct FenceType {
+			enum : uint64_t {
+				FENCE = 0x00,
+				FENCE_I = 0x01
+			};
+		};
+
 		struct CSRType {
 			enum : uint64_t {
 				ENVIRONMENT = 0x00,
@@ -199,6 +206,9 @@ namespace Emulator {
 				WFI = 0x05,
 				OTHER = 0x06,
 
+				SFENCEWINVAL = 0x00,
+				SFENCEINVALIR = 0x01,
+
 				ECALL7 = 0x00,
 				EBREAK7 = 0x00,
 				URET7 = 0x00,
@@ -206,6 +216,8 @@ namespace Emulator {
 				MRET7 = 0x18,
 				WFI7 = 0x08,
 				SFENCEVMA7 = 0x09,
+				SINVALVMA7 = 0x0b,
+				SFENCEINVAL7 = 0x0c,
 				HFENCEBVMA7 = 0x11,
 				HFENCEGVMA7 = 0x51
 			};
@@ -458,6 +470,34 @@ namespace Emulator {
 			return insn & 0x03U;
 		}
 
+		inline bool ends_block(void) const
+		{
+			if (size() == 2) {
+				switch (opcode_c()) {
+				case OpcodeType::COMPRESSED_QUANDRANT1:
+					return funct3_c() == Q1::J ||
+						funct3_c() == Q1::BEQZ ||
+						funct3_c() == Q1::BNEZ;
+				case OpcodeType::COMPRESSED_QUANDRANT2:
+					return funct3_c() == Q2::OP04 &&
+						((insn >> 2U) & 0x1fU) == 0;
+				default:
+					return false;
+				}
+			}
+
+			switch (opcode()) {
+			case OpcodeType::B:
+			case OpcodeType::JAL:
+			case OpcodeType::JALR:
+			case OpcodeType::FENCE:
+			case OpcodeType::CSR:
+				return true;
+			default:
+				return false;
+			}
+		}
+
 		inline uint64_t rd_c(void) const
 		{
 			return ((insn >> 2U) & 0x07U) + 8U;
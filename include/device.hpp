@@ -4,6 +4,17 @@
 #include <string_view>
 
 namespace Emulator {
+	enum class DeviceName : size_t {
+		CLINT = 0,
+		DRAM,
+		GPU,
+		PLIC,
+		SYSCON,
+		VIRTIO,
+
+		SIZE
+	};
+
 	class Device {	
 	public:
 		const uint64_t base;
@@ -12,6 +23,25 @@ namespace Emulator {
 		virtual uint64_t load(uint64_t addr, uint64_t len) = 0;
 		virtual void store(uint64_t addr, uint64_t value, uint64_t len) = 0;
 		virtual void dump(void) const = 0;
+		virtual void tick(void) {};
+
+		// Ends any host thread of the device, the bus
+		// stops every device before freeing the first
+		virtual void stop(void) {};
+
+		// Bulk copies for DMA, one byte access at a
+		// time unless the device can do better
+		virtual void read_span(uint64_t addr, uint8_t *dst, uint64_t len)
+		{
+			for (uint64_t i = 0; i < len; i++)
+				dst[i] = load(addr + i, 8);
+		}
+
+		virtual void write_span(uint64_t addr, const uint8_t *src, uint64_t len)
+		{
+			for (uint64_t i = 0; i < len; i++)
+				store(addr + i, src[i], 8);
+		}
 
 		inline Device(uint64_t _base, uint64_t _size) :
 			base(_base), size(_size) {};
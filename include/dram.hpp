@@ -2,19 +2,80 @@
 
 #include <cstdint>
 #include <cstring>
+#include <string>
 #include <vector>
+#include "common.hpp"
 #include "errors.hpp"
 #include "device.hpp"
 
 namespace Emulator {
+	struct DramBacking {
+		bool hugetlb = false;
+		int64_t numa_node = -1;
+	};
+
 	class Dram : public Device {
+	public:
+		using Backing = DramBacking;
+
 	private:
-		std::vector<uint8_t> data;
+		// Anonymous mapping, host pages are only
+		// populated when the guest first touches them
+		uint8_t *data = nullptr;
+		uint64_t mapped = 0;
+
+		void map(const Backing& backing);
+		void bind(int64_t numa_node);
 
 	public:
-		explicit Dram(uint64_t _base, uint64_t _size, std::vector<uint8_t> _data = {});
+		explicit Dram(uint64_t _base, uint64_t _size, Backing backing = {});
+		explicit Dram(uint64_t _base, uint64_t _size, 
+			const std::vector<uint8_t>& _data, Backing backing = {});
+		~Dram() override;
+
+		Dram(const Dram&) = delete;
+		Dram& operator=(const Dram&) = delete;
+
+		inline bool contains(uint64_t addr, uint64_t len) const
+		{
+			return addr >= base && addr - base + len <= size;
+		}
+
+		inline uint8_t *host(uint64_t addr)
+		{
+			return data + (addr - base);
+		}
+
+		template<uint64_t N>
+		inline uint64_t load(uint64_t addr) const
+		{
+			uint_t<N> value;
+			std::memcpy(&value, data + (addr - base), sizeof(value));
+			return value;
+		}
+
+		template<uint64_t N>
+		inline void store(uint64_t addr, uint64_t value)
+		{
+			uint_t<N> narrow = value;
+			std::memcpy(data + (addr - base), &narrow, sizeof(narrow));
+		}
+
+		inline void read_span(uint64_t addr, uint8_t *dst, uint64_t len) override
+		{
+			std::memcpy(dst, data + (addr - base), len);
+		}
+
+		inline void write_span(uint64_t addr, const uint8_t *src, uint64_t len) override
+		{
+			std::memcpy(data + (addr - base), src, len);
+		}
+
+		void copy(const std::vector<uint8_t>& img, uint64_t off);
 
-		void copy(std::vector<uint8_t>& img, uint64_t off);
+		// Places a file at off, on Linux mapped copy-on-write
+		// when the offset is page aligned, read in place otherwise
+		void load_image(const std::string& path, uint64_t off);
 		uint64_t load(uint64_t addr, uint64_t len) override;
 		void store(uint64_t addr, uint64_t value, uint64_t len) override;
 		void dump(void) const override;
@@ -5,9 +5,13 @@
 #include "cpu.hpp"
 #include "bus.hpp"
 #include "mmu.hpp"
+#include "machine.hpp"
 
 namespace Emulator {
 	class Emulator {
+	private:
+		std::unique_ptr<Machine> machine;
+
 	public:
 		explicit Emulator(int argc, char *argv[]);
 	};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Emulator {
+	class Fdt {
+	public:
+		struct Property {
+			std::string name;
+			std::vector<uint8_t> value;
+		};
+
+		struct Node {
+			std::string name;
+			std::vector<Property> props;
+			std::vector<Node> children;
+
+			Node *child(std::string_view name);
+			std::vector<uint8_t> *prop(std::string_view name);
+			void set(std::string_view name, std::vector<uint32_t> values);
+		};
+
+		Node root;
+
+		explicit inline Fdt(void) = default;
+
+		// False if the property is too short to hold cell idx
+		static bool cell(const std::vector<uint8_t>& value, uint64_t idx, uint32_t& out);
+		static std::vector<uint8_t> cells(const std::vector<uint32_t>& values);
+
+		// Parses a flattened device tree blob, false if it is malformed
+		bool load(const std::vector<uint8_t>& blob);
+		std::vector<uint8_t> save(void) const;
+
+	private:
+		std::vector<uint8_t> reserved;
+		uint32_t boot_cpuid = 0;
+	};
+};
@@ -65,6 +65,9 @@ namespace Emulator {
 		int32_t term_rows = 32;
 		int32_t term_cols = 120;
 	
+		static constexpr uint64_t TICK_PERIOD = 0x10000;
+		static constexpr uint32_t UART_IRQN = 10;
+
 		uint64_t last_tick = 0;
 		uint64_t last_text = ~0ULL;
 		
@@ -79,27 +82,13 @@ namespace Emulator {
 		void dispatch(void);
 		
 	public:
-		bool is_uart_interrupting = false;
-		
 		explicit Gpu(uint32_t _width, uint32_t _height);
 		virtual ~Gpu(void);
 
-		inline const uint32_t *interrupting(void)
-		{
-			static const uint32_t UART_IRQN = 10;
-
-			if (is_uart_interrupting) {
-				is_uart_interrupting = false;
-				return &UART_IRQN;
-			}
-
-			return nullptr;
-		}
-		
 		uint64_t load(uint64_t addr, uint64_t len) override;
 		void store(uint64_t addr, uint64_t value, uint64_t len) override;
 		void dump(void) const override;
-		void tick(void);
+		void tick(void) override;
 		void render(void);
 	};
 };
@@ -4,6 +4,53 @@
 
 namespace Emulator {
 	namespace Instruction {
+		struct Op;
+
+		using exec_t = void (*)(const Op&);
+
+		struct Op {
+			exec_t exec;
+			exec_t run;
+			uint64_t imm;
+			uint32_t insn;
+			uint8_t rd;
+			uint8_t rs1;
+			uint8_t rs2;
+			uint8_t size;
+			// Guest instructions retired by the op
+			uint8_t count;
+		};
+
+		struct Kind {
+			enum : uint64_t {
+				NONE = 0, END, NOP,
+				ADD, SUB, SLL, SLT, SLTU, XOR, SRL, SRA, OR, AND, MUL,
+				ADDW, SUBW, SLLW, SRLW, SRAW, MULW,
+				ADDI, SLTI, SLTIU, XORI, ORI, ANDI, SLLI, SRLI, SRAI,
+				ADDIW, SLLIW, SRLIW, SRAIW,
+				LB, LH, LW, LD, LBU, LHU, LWU, SB, SH, SW, SD,
+				LUI, AUIPC, JAL, JALR,
+				BEQ, BNE, BLT, BGE, BLTU, BGEU
+			};
+		};
+
+		struct Fusion {
+			enum : uint64_t {
+				LUI_ADDI = 0,
+				AUIPC_ADDI,
+				AUIPC_JALR,
+				SLLI_SRLI,
+				LI_BRANCH,
+				MV_BRANCH,
+
+				SIZE
+			};
+		};
+
 		uint64_t execute(Decoder decoder);
+		Op decode(Decoder decoder);
+		Op terminator(void);
+		uint64_t kind(const Op& op);
+		bool fuse(Op& first, const Op& second);
 	};
 };
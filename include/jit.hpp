@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "common.hpp"
+#include "instruction.hpp"
+
+namespace Emulator {
+	// Translates the integer ALU ops, loads, stores and branches of a
+	// hot block, every other op calls back into its interpreter handler.
+	// Loads and stores probe the DTLB inline and only go through the Mmu
+	// on a miss. Guest registers stay in cpu->int_regs. A branch or jal
+	// to a translated block of the same page jumps straight into it, up
+	// to CHAIN_LIMIT instructions before returning to Cpu::iterate
+	class Jit {
+	public:
+		using code_t = uint64_t (*)(void);
+
+		static constexpr uint32_t HOT_THRESHOLD = 16;
+
+		// Exit of the last compiled block that leads to target,
+		// jumps through slot once that block is translated
+		struct Link {
+			uint64_t target;
+			uint64_t *slot;
+		};
+
+	private:
+		static constexpr uint64_t CODE_SIZE = BYTE_SIZE<MIB>(16);
+		static constexpr uint64_t MAX_LINKS = 0x10000;
+		static constexpr uint64_t CHAIN_LIMIT = 4096;
+
+		// Size of the prologue, where chained blocks enter
+		static constexpr uint64_t BODY = 27;
+
+		struct Reg {
+			enum : uint8_t {
+				RAX = 0,
+				RCX = 1,
+				RSI = 6,
+				RDI = 7,
+				R8 = 8
+			};
+		};
+
+		struct Cond {
+			enum : uint8_t {
+				B = 0x02,
+				AE = 0x03,
+				E = 0x04,
+				NE = 0x05,
+				A = 0x07,
+				L = 0x0c,
+				GE = 0x0d,
+
+				ALWAYS = 0xff
+			};
+		};
+
+		uint8_t *code = nullptr;
+		uint64_t used = 0;
+		bool full = false;
+
+		// Start of the buffer, one DTLB probe per
+		// access type, LOAD and STORE
+		uint8_t *probes[2] = {};
+
+		std::vector<uint8_t> buf;
+		std::vector<uint64_t> exits;
+
+		// Stay put until reset(), the code reads them
+		std::vector<uint64_t> slots;
+		uint64_t slots_used = 0;
+		std::vector<Link> links;
+
+		// Of the block being compiled, offset is that of the op
+		uint64_t start = 0;
+		uint64_t offset = 0;
+		bool linkable = false;
+
+		using handler_t = bool (*)(const Instruction::Op*);
+
+		void emit(std::initializer_list<uint8_t> bytes);
+		void emit32(uint32_t value);
+		void emit64(uint64_t value);
+		uint64_t jump(uint8_t cond);
+		void jump_to(uint8_t cond, uint64_t target);
+		void bind(uint64_t at);
+		uint8_t *install(void);
+
+		void mov(uint8_t reg, uint64_t value);
+
+		void load(uint8_t reg, uint64_t index);
+		void store(uint8_t reg, uint64_t index);
+		void alu(uint8_t opcode, uint64_t index, bool wide = true);
+		void alu_imm(uint8_t opcode, uint64_t imm, bool wide = true);
+		void shift(uint8_t ext, bool wide = true);
+		void shift_imm(uint8_t ext, uint8_t amount, bool wide = true);
+		void set(uint8_t cond);
+		void add_rax(int64_t value);
+		void add_pc(int64_t value);
+		void leave(uint64_t retired);
+		void leave_to(uint64_t delta, int64_t value, uint64_t retired);
+		void call(const Instruction::Op& op, handler_t handler);
+		void probe(uint64_t access_type, const uint8_t *code_pages);
+		void memory(const Instruction::Op& op, uint64_t kind,
+			uint64_t delta, uint64_t retired);
+
+		bool native(const Instruction::Op& op, uint64_t& delta,
+			uint64_t retired);
+
+	public:
+		explicit inline Jit(void) = default;
+		~Jit(void);
+
+		inline bool is_full(void) const
+		{
+			return full;
+		}
+
+		inline void reset(void)
+		{
+			used = 0;
+			slots_used = 0;
+			full = false;
+		}
+
+		inline const std::vector<Link>& get_links(void) const
+		{
+			return links;
+		}
+
+		static inline void link(uint64_t *slot, code_t native)
+		{
+			*slot = reinterpret_cast<uint64_t>(native) + BODY;
+		}
+
+		// addr is the physical address of the block, stores
+		// into pages flagged in code_pages take the slow path
+		code_t compile(const std::vector<Instruction::Op>& ops,
+			uint64_t addr, const uint8_t *code_pages);
+	};
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <atomic>
+#include "cpu.hpp"
+#include "mmu.hpp"
+#include "bus.hpp"
+
+namespace Emulator {
+	// Owns the harts and the bus of one emulated system. The execution
+	// path keeps reaching them through the thread_local cpu, mmu and bus
+	// rather than a context passed down every handler, each host thread
+	// is bound to one hart of one machine and bind() sets those pointers
+	class Machine {
+	public:
+		struct Hart {
+			std::unique_ptr<Cpu> cpu;
+			std::unique_ptr<Mmu> mmu;
+		};
+
+		std::vector<Hart> harts;
+		std::unique_ptr<Bus> bus;
+
+		explicit inline Machine(uint64_t hart_count = 1) :
+			bus(std::make_unique<Bus>())
+		{
+			harts.reserve(hart_count);
+
+			for (uint64_t hartid = 0; hartid < hart_count; hartid++)
+				harts.push_back({
+					std::make_unique<Cpu>(hartid),
+					std::make_unique<Mmu>()
+				});
+
+			bind();
+		}
+
+		inline ~Machine(void)
+		{
+			if (Emulator::bus == bus.get())
+				unbind();
+		}
+
+		Machine(const Machine&) = delete;
+		Machine& operator=(const Machine&) = delete;
+
+		// Points cpu, mmu and bus of the calling host thread at a hart
+		inline void bind(uint64_t hartid = 0)
+		{
+			Emulator::cpu = harts[hartid].cpu.get();
+			Emulator::mmu = harts[hartid].mmu.get();
+			Emulator::bus = bus.get();
+		}
+
+		static inline void unbind(void)
+		{
+			Emulator::cpu = nullptr;
+			Emulator::mmu = nullptr;
+			Emulator::bus = nullptr;
+		}
+
+		// Runs every hart on its own host thread, the boot hart on the
+		// calling one, until any of them fails, then rethrows that failure
+		void run(void);
+
+	private:
+		std::atomic<bool> running = false;
+	};
+};
@@ -1,27 +1,63 @@
 #pragma once
 
 #include "bus.hpp"
+#include "common.hpp"
 #include "cpu.hpp"
 #include <array>
 #include <memory>
 #include <cstdint>
+#include <cstring>
 
 namespace Emulator {
 	class Mmu {
+		// Reads the DTLB from the code it generates
+		friend class Jit;
+
     private:		
 		struct TLBEntry {
 			uint64_t virt_base;
 			uint64_t phys_base;
+			uint64_t page_mask;
 			uint64_t pte;
 			uint64_t pte_addr;
-			uint64_t age;
+			uint64_t asid;
+			uint64_t generation;
+			uint8_t *host;
+			uint8_t perms;
 			bool is_dirty;
 			bool is_accessed;
 			bool is_read;
 			bool is_write;
 			bool is_execute;
 			bool is_user;
+			bool is_global;
+		};
+
+		static constexpr uint64_t TLB_SETS = 256;
+		static constexpr uint64_t TLB_WAYS = 4;
+		static constexpr uint64_t TLB_LARGE = 16;
+
+		// Superpages and NAPOT ranges live in a small fully
+		// associative array, they would alias in the sets
+		struct TLB {
+			std::array<TLBEntry, TLB_SETS * TLB_WAYS> entries{};
+			std::array<uint8_t, TLB_SETS> victim{};
+			std::array<TLBEntry, TLB_LARGE> large{};
+			uint8_t large_victim = 0;
 		};
+
+		// Table reached through the non-leaf PTEs above a level,
+		// a walk resumes from the deepest one that is cached
+		struct WalkEntry {
+			uint64_t prefix;
+			uint64_t table;
+			uint64_t asid;
+			uint64_t generation;
+			bool is_global;
+		};
+
+		static constexpr uint64_t WALK_LEVELS = 4;
+		static constexpr uint64_t WALK_ENTRIES = 64;
 	
 		struct ModeValue {
 			enum : uint64_t {
@@ -37,30 +73,70 @@ namespace Emulator {
 				VALID = 0, READ,
 				WRITE, EXECUTE,
 				USER, GLOBAL,
-				ACCESSED, DIRTY
+				ACCESSED, DIRTY,
+
+				NAPOT = 63
 			};
 		};
 		
-		struct AccessType {
+		// R, W, X and U of a PTE shifted down to bit 0
+		struct Perm {
 			enum : uint64_t {
-				LOAD = 0,
-				STORE,
-				INSTRUCTION
+				READ = 1 << 0,
+				WRITE = 1 << 1,
+				EXECUTE = 1 << 2,
+				USER = 1 << 3
 			};
 		};
-		
+
 		static constexpr uint64_t PAGE_SIZE = 4096;
+		static constexpr uint64_t PAGE_MASK = ~(PAGE_SIZE - 1);
+		static constexpr uint64_t NAPOT_MASK = ~0xffffULL;
 		
 		uint64_t mode;
-		std::array<TLBEntry, 4> tlb_cache;
-		uint32_t mppn;
+		uint64_t asid;
+		uint64_t mppn;
 
-	public:
-        explicit inline Mmu(void) : mode(ModeValue::BARE), tlb_cache{}
+		// Effective privilege of fetches and of loads/stores, and per
+		// access type a bitmap of the PTE permissions it may use
+		uint64_t fetch_mode;
+		uint64_t data_mode;
+		std::array<uint16_t, 3> allowed;
+
+		// Entries of an older generation are stale, which
+		// makes a full flush a single increment
+		uint64_t generation;
+		TLB itlb;
+		TLB dtlb;
+
+		// Translation of the code page of the last fetch, dropped
+		// together with the TLB and on any privilege change
+		struct FetchBuffer {
+			uint64_t page = ~0ULL;
+			uint64_t phys = 0;
+			uint8_t *host = nullptr;
+		} fetch_buffer;
+		std::array<std::array<WalkEntry, WALK_ENTRIES>, WALK_LEVELS> walk_cache{};
+
+		inline uint64_t get_prefix(uint64_t addr, uint64_t level) const
 		{
-			flush_tlb();
+			return addr >> (12ULL + (level + 1) * 9ULL);
 		}
 
+	public:
+		struct AccessType {
+			enum : uint64_t {
+				LOAD = 0,
+				STORE,
+				INSTRUCTION
+			};
+		};
+
+        explicit inline Mmu(void) : 
+			mode(ModeValue::BARE), asid(0), mppn(0),
+			fetch_mode(Cpu::Mode::MACHINE), data_mode(Cpu::Mode::MACHINE),
+			allowed{}, generation(1) {};
+
 		inline uint32_t get_levels(void)
 		{
 			switch (mode) {
@@ -73,14 +149,12 @@ namespace Emulator {
 
 		inline void flush_tlb(void)
 		{
-			static constexpr uint32_t reset_age = 
-				std::numeric_limits<uint32_t>::max();
-			
-			tlb_cache = {};
-
-			for (TLBEntry& entry : tlb_cache)
-				entry.age = reset_age;
+			++generation;
+			fetch_buffer = {};
 		}
+
+		// SFENCE.VMA, a register operand of x0 matches everything
+		void flush_tlb(bool by_addr, uint64_t addr, bool by_asid, uint64_t asid);
 		
 		inline std::array<uint64_t, 5> get_vpn(uint64_t addr)
 		{
@@ -128,20 +202,85 @@ namespace Emulator {
 				cpu->set_exception(Exception::INSTRUCTION_PAGE_FAULT, addr);
 				break;
 			}
+		}
+
+		// host is set when the page of the access is backed by DRAM
+		uint64_t translate(uint64_t addr, uint64_t access_type, uint8_t *&host);
+		uint8_t *get_host(uint64_t p_addr, uint64_t page_mask = PAGE_MASK);
 
-			flush_tlb();
+		inline uint64_t translate(uint64_t addr, uint64_t access_type)
+		{
+			uint8_t *host;
+
+			return translate(addr, access_type, host);
+		}
+
+		bool fetch_pte(uint64_t addr, uint64_t access_type, TLBEntry& entry);
+		TLBEntry *get_tlb_entry(uint64_t addr, uint64_t access_type);
+		bool set_accessed(TLBEntry& entry, uint64_t access_type);
+		template<uint64_t N>
+		inline uint64_t load(uint64_t addr)
+		{
+			uint8_t *host;
+			uint64_t p_addr = translate(addr, AccessType::LOAD, host);
+
+			if (cpu->exception.current != Exception::NONE)
+				return 0;
+
+			if (host && (addr & ~PAGE_MASK) + N / 8 <= PAGE_SIZE) {
+				uint_t<N> value;
+				std::memcpy(&value, host, sizeof(value));
+				return value;
+			}
+
+			return bus->load<N>(p_addr);
+		}
+
+		template<uint64_t N>
+		inline void store(uint64_t addr, uint64_t value)
+		{
+			uint8_t *host;
+			uint64_t p_addr = translate(addr, AccessType::STORE, host);
+
+			if (cpu->exception.current != Exception::NONE)
+				return;
+
+			if (host && (addr & ~PAGE_MASK) + N / 8 <= PAGE_SIZE) {
+				uint_t<N> data = value;
+				std::memcpy(host, &data, sizeof(data));
+				cpu->block_cache.invalidate(p_addr);
+				return;
+			}
+
+			bus->store<N>(p_addr, value);
 		}
 
-		uint64_t translate(uint64_t addr, uint64_t access_type);
-		bool fetch_pte(uint64_t addr, uint64_t access_type, 
-			uint64_t cpu_mode, TLBEntry& entry);
-		TLBEntry *get_tlb_entry(uint64_t addr, uint64_t access_type,
-			uint64_t cpu_mode);
 		uint64_t load(uint64_t addr, uint64_t len);
 		void store(uint64_t addr, uint64_t value, uint64_t len);
-		uint64_t fetch(uint64_t addr, uint64_t len = 64);
+		uint32_t fetch(uint64_t addr);
+		uint64_t refill(uint64_t addr, uint8_t *&host);
+
+		inline uint64_t translate_fetch(uint64_t addr, uint8_t *&host)
+		{
+			if ((addr & PAGE_MASK) != fetch_buffer.page)
+				return refill(addr, host);
+
+			host = fetch_buffer.host ?
+				fetch_buffer.host + (addr & ~PAGE_MASK) : nullptr;
+
+			return fetch_buffer.phys | (addr & ~PAGE_MASK);
+		}
+
+		inline uint64_t translate_fetch(uint64_t addr)
+		{
+			uint8_t *host;
+
+			return translate_fetch(addr, host);
+		}
+		// Rederives the state above from satp, mstatus and the
+		// privilege mode, called whenever one of them changes
 		void update(void);
 	};
 
-	extern std::unique_ptr<Mmu> mmu;
+	extern thread_local Mmu *mmu;
 };
@@ -1,63 +1,86 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include "device.hpp"
 #include "errors.hpp"
+#include "settings.hpp"
 
 namespace Emulator {
 	class Plic : public Device {
-	private:		
+	public:
+		struct Context {
+			enum : uint64_t {
+				MACHINE = 0,
+				SUPERVISOR = 1,
+
+				SIZE = 2 * MAX_HARTS
+			};
+		};
+
+	private:
 		template<uint64_t S>
 		using Region = std::array<uint32_t, S>;
 
-		Region<1024> priority;
+		Region<1024> priority{};
 		static constexpr uint64_t PRIORITY_BASE = 0x0C000000ULL;
 		static constexpr uint64_t PRIORITY_SIZE = 0xFFFULL;
 
-		Region<32> pending;
+		Region<32> pending{};
 		static constexpr uint64_t PENDING_BASE = 0x0C001000ULL;
 		static constexpr uint64_t PENDING_SIZE = 0x7FULL;
 
-		Region<64> enable;
+		Region<Context::SIZE * 32> enable{};
 		static constexpr uint64_t ENABLE_BASE = 0x0C002000ULL;
-		static constexpr uint64_t ENABLE_SIZE = 0xFFULL;
+		static constexpr uint64_t ENABLE_SIZE = Context::SIZE * 0x80ULL - 1;
 
-		Region<2> treshold;
-		Region<2> claim;
+		Region<Context::SIZE> treshold{};
 		static constexpr uint64_t TRESHOLD_CLAIM_BASE = 0x0C200000ULL;
-		static constexpr uint64_t TRESHOLD_CLAIM_SIZE = 0x1007ULL;
-	
+		static constexpr uint64_t TRESHOLD_CLAIM_SIZE =
+			0x1000ULL * (Context::SIZE - 1) + 7;
+
+		// One bit per context with a claimable interrupt, read by
+		// every hart without taking the bus lock
+		std::atomic<uint64_t> raised = 0;
+
+		uint64_t best(uint64_t ctx) const;
+		void update(void);
+
 	public:
-		explicit inline Plic(void) : 
-			Device(0x0C000000ULL, 0x208000ULL) {};
+		explicit inline Plic(void) :
+			Device(0x0C000000ULL, 0x4000000ULL) {};
 
-		inline bool is_enabled(uint64_t ctx, uint64_t irq)
+		static constexpr inline uint64_t context(uint64_t hartid, uint64_t level)
+		{
+			return hartid * 2 + level;
+		}
+
+		inline bool is_enabled(uint64_t ctx, uint64_t irq) const
 		{
 			uint64_t idx = (irq % 1024) / 32;
 			uint64_t off = (irq % 1024) % 32;
 
 			return ((enable[ctx * 32 + idx] >> off) & 1) == 1;
 		}
-		
-		inline void update_claim(uint64_t irq)
+
+		inline bool is_raised(uint64_t ctx) const
 		{
-			if (is_enabled(1, irq) || irq == 0)
-				claim[1] = irq;
+			return (raised.load(std::memory_order_relaxed) >> ctx) & 1;
 		}
-		
+
 		inline void clear_pending(uint64_t irq)
 		{
-			pending[irq / 4] &= ~(1U << irq);
-			update_claim(0);
+			pending[(irq % 1024) / 32] &= ~(1U << (irq % 32));
+			update();
 		}
 
 		inline void update_pending(uint64_t irq)
 		{
-			pending[irq / 4] |= 1U << irq;
-			update_claim(irq);
+			pending[(irq % 1024) / 32] |= 1U << (irq % 32);
+			update();
 		}
-		
-		uint64_t load(uint64_t addr, uint64_t len) override;	
+
+		uint64_t load(uint64_t addr, uint64_t len) override;
 		void store(uint64_t addr, uint64_t value, uint64_t len) override;
 		void dump(void) const override;
 	};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include "settings.hpp"
+
+namespace Emulator {
+	// LR/SC reservations of every hart, one granule each. SC also
+	// compares the reserved value with a CAS, which catches plain
+	// stores from other harts without them having to check this table
+	class ReservationTable {
+	private:
+		static constexpr uint64_t GRANULE = 8;
+		static constexpr uint64_t NONE = ~0ULL;
+
+		struct Entry {
+			std::atomic<uint64_t> granule = NONE;
+			uint64_t value = 0;
+		};
+
+		std::array<Entry, MAX_HARTS> entries;
+
+	public:
+		explicit inline ReservationTable(void) = default;
+
+		inline void reserve(uint64_t hartid, uint64_t addr, uint64_t value)
+		{
+			entries[hartid].value = value;
+			entries[hartid].granule.store(
+				addr / GRANULE, std::memory_order_relaxed
+			);
+		}
+
+		// Drops the reservation of the hart, true if it covered addr
+		inline bool take(uint64_t hartid, uint64_t addr, uint64_t& value)
+		{
+			uint64_t granule = entries[hartid].granule.exchange(
+				NONE, std::memory_order_relaxed
+			);
+
+			value = entries[hartid].value;
+			return granule == addr / GRANULE;
+		}
+
+		inline void invalidate(uint64_t addr)
+		{
+			uint64_t granule = addr / GRANULE;
+
+			for (Entry& entry : entries) {
+				uint64_t expected = granule;
+
+				if (entry.granule.load(std::memory_order_relaxed) == granule)
+					entry.granule.compare_exchange_strong(
+						expected, NONE, std::memory_order_relaxed
+					);
+			}
+		}
+	};
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <algorithm>
+#include "device.hpp"
+
+namespace Emulator {
+	class Scheduler {
+	private:
+		static constexpr uint64_t NEVER = ~0ULL;
+
+		std::array<
+			uint64_t,
+			static_cast<size_t>(DeviceName::SIZE)
+		> deadlines{};
+
+		uint64_t now = 0;
+		uint64_t next = 0;
+
+	public:
+		// Only the boot hart ticks the shared devices, every
+		// hart ticks the CLINT to see its own msip and mtimecmp
+		explicit inline Scheduler(uint64_t hartid = 0)
+		{
+			if (hartid) {
+				deadlines.fill(NEVER);
+				deadlines[static_cast<size_t>(DeviceName::CLINT)] = 0;
+			}
+		}
+
+		inline bool expired(uint64_t _now)
+		{
+			now = _now;
+			return now >= next;
+		}
+
+		inline void schedule(DeviceName name, uint64_t delay)
+		{
+			uint64_t deadline = now + delay;
+
+			deadlines[static_cast<size_t>(name)] = deadline;
+			next = std::min(next, deadline);
+		}
+
+		inline void cancel(DeviceName name)
+		{
+			deadlines[static_cast<size_t>(name)] = NEVER;
+		}
+
+		// Runs the devices due at the earliest deadline without
+		// waiting for the cycle counter, used by an idle hart. The
+		// skipped cycles come off every deadline rather than moving
+		// now past CYCLE, which does not count while the hart sleeps
+		inline void advance(void)
+		{
+			uint64_t skipped = next > now ? next - now : 0;
+
+			for (uint64_t& deadline : deadlines)
+				if (deadline != NEVER)
+					deadline -= skipped;
+
+			run();
+		}
+
+		void run(void);
+	};
+};
@@ -1,11 +1,16 @@
 #pragma once
 
 #include <array>
-#include <vector>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
 #include "device.hpp"
 #include "common.hpp"
 
 namespace Emulator {	
+	class Bus;
+
 	class Virtio : public Device {
 	private:
 		enum : uint64_t {
@@ -38,8 +43,10 @@ namespace Emulator {
 			VERSION_LEGACY 	= 0x1,
 			VENDOR 			= 0x554d4551,
 			BLK_DEV 		= 0x2,
-			DISK_DELAY 		= 0x1f4,
-			SECTOR_SIZE 	= 0x200
+			BLK_F_RO		= 0x5,
+			BLK_F_FLUSH		= 0x9,
+			SECTOR_SIZE 	= 0x200,
+			VIRTIO_IRQN		= 0x1
 		};
 
 		enum : uint16_t {
@@ -52,7 +59,10 @@ namespace Emulator {
 		enum : uint8_t {
 			BLK_T_IN  		= 0x0,
 			BLK_T_OUT 		= 0x1,
-			BLK_S_OK  		= BLK_T_IN
+			BLK_T_FLUSH		= 0x4,
+			BLK_S_OK  		= 0x0,
+			BLK_S_IOERR		= 0x1,
+			BLK_S_UNSUPP	= 0x2
 		};
 	
 		struct VRingAvail {
@@ -68,6 +78,17 @@ namespace Emulator {
 			uint16_t next;
 		};
 
+		struct VRingUsedElem {
+			uint32_t id;
+			uint32_t len;
+		};
+
+		struct BlkReq {
+			uint32_t type;
+			uint32_t reserved;
+			uint64_t sector;
+		};
+
 		struct Virtq {
 			uint64_t desc;
 			uint64_t avail;
@@ -78,14 +99,29 @@ namespace Emulator {
 		};
 
 		Virtq vq = {0};
-		std::vector<uint8_t> rfsimg;
+
+		// Disk image, requests go straight to the file
+		int fd = -1;
+		uint64_t disk_size = 0;
+		bool read_only = false;
+
+		// Bounce buffer for ranges DRAM does not back whole,
+		// larger descriptors go through it a chunk at a time
+		static constexpr uint64_t CHUNK_SIZE = 64 * 1024;
+		std::array<uint8_t, CHUNK_SIZE> buffer;
+
+		// Requests are served on a host thread of their own,
+		// a queue notify from a hart only wakes it up
+		std::thread worker;
+		std::mutex worker_lock;
+		std::condition_variable worker_cond;
+		bool notified = false;
+		bool stopping = false;
+
 		std::array<uint32_t, 2> host_feat = {0};
 		std::array<uint32_t, 2> guest_feat = {0};
 		std::array<uint8_t, 8> config = {0};
 
-		uint64_t clock = 0;
-		uint64_t notify_clock = 0;
-
 		uint32_t host_feat_sel = 0;
 		uint32_t guest_feat_sel = 0;
 		uint32_t guest_page_size = 0;
@@ -93,37 +129,36 @@ namespace Emulator {
 		uint32_t queue_notify = 0;
 
 		uint16_t id = 0;
+		uint16_t last_avail = 0;
 		uint16_t queue_sel = 0;
 
 		uint8_t isr = 0;
 		uint8_t status = 0;
 
 	public:
-		explicit Virtio(std::vector<uint8_t> data);
+		explicit Virtio(const std::string& path, bool _read_only = false);
+		~Virtio() override;
+
+		Virtio(const Virtio&) = delete;
+		Virtio& operator=(const Virtio&) = delete;
 
 		uint64_t load(uint64_t addr, uint64_t len) override;
 		void store(uint64_t addr, uint64_t value, uint64_t len) override;
 		void dump(void) const override;
-
-		inline const uint32_t *interrupting(void)
-		{
-			static const uint32_t VIRTIO_IRQN = 1;
-
-			if (isr & 1)
-				return &VIRTIO_IRQN;
-
-			return nullptr;
-		}
+		void stop(void) override;
 
 		inline void reset(void)
 		{
 			id = 0;
+			last_avail = 0;
 			isr = 0;
 		}
 		
-		void tick(void);
 		void update(void);
 		VirtqDesc load_desc(uint64_t addr);
+		uint8_t transfer(uint32_t type, uint64_t off, const VirtqDesc& desc);
+		uint8_t request(const Virtq& queue, uint16_t head, uint32_t& written);
 		void access_disk(void);
+		void work(Bus *owner);
 	};
 };
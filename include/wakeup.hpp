@@ -0,0 +1,49 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include "settings.hpp"
+
+namespace Emulator {
+	// Parks the host thread of a hart in WFI until a device
+	// or another hart raises something for it
+	class WakeupTable {
+	private:
+		struct Entry {
+			std::mutex lock;
+			std::condition_variable cond;
+			bool pending = false;
+		};
+
+		std::array<Entry, MAX_HARTS> entries;
+
+	public:
+		explicit inline WakeupTable(void) = default;
+
+		inline void wait(uint64_t hartid, std::chrono::microseconds timeout)
+		{
+			Entry& entry = entries[hartid];
+			std::unique_lock guard(entry.lock);
+
+			entry.cond.wait_for(guard, timeout, [&entry] {
+				return entry.pending;
+			});
+			entry.pending = false;
+		}
+
+		inline void wake(uint64_t hartid)
+		{
+			Entry& entry = entries[hartid];
+
+			{
+				std::scoped_lock guard(entry.lock);
+				entry.pending = true;
+			}
+
+			entry.cond.notify_one();
+		}
+	};
+};
@@ -0,0 +1,137 @@
+#include <algorithm>
+#include "block.hpp"
+#include "bus.hpp"
+#include "cpu.hpp"
+
+using namespace Emulator;
+
+void BlockCache::apply(void)
+{
+	if (flush_pending || blocks.size() >= MAX_BLOCKS) {
+		blocks.clear();
+		page_blocks.clear();
+		std::fill(code_pages.begin(), code_pages.end(), 0);
+		links.clear();
+		jit.reset();
+	} else {
+		for (uint64_t page : pending_pages) {
+			uint64_t base = code_base + page * PAGE_SIZE;
+
+			// Blocks only link within their page
+			links.erase(
+				links.lower_bound(base),
+				links.lower_bound(base + PAGE_SIZE)
+			);
+
+			auto it = page_blocks.find(page);
+			if (it == page_blocks.end())
+				continue;
+
+			for (uint64_t addr : it->second)
+				blocks.erase(addr);
+
+			page_blocks.erase(it);
+		}
+	}
+
+	pending_pages.clear();
+	flush_pending = false;
+	stale = false;
+}
+
+BlockCache::Block *BlockCache::build(uint64_t addr)
+{
+	Device *dram = bus->get(DeviceName::DRAM);
+
+	if (!dram || bus->get(addr) != dram)
+		return nullptr;
+
+	uint64_t start = addr;
+	uint64_t page_end = (addr & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+	Block block;
+	block.addr = start;
+
+	while (block.ops.size() < MAX_OPS && addr + 2 <= page_end) {
+		uint32_t insn = (page_end - addr >= 4) ?
+			dram->load(addr, 32) : dram->load(addr, 16);
+		Decoder decoder(insn);
+
+		if (addr + decoder.size() > page_end)
+			break;
+
+		Instruction::Op op = Instruction::decode(decoder);
+
+		if (block.ops.empty() || !Instruction::fuse(block.ops.back(), op))
+			block.ops.push_back(op);
+
+		if (!insn || decoder.ends_block())
+			break;
+
+		addr += decoder.size();
+	}
+
+	if (block.ops.empty())
+		return nullptr;
+
+	block.ops.push_back(Instruction::terminator());
+
+	// Translated code holds on to code_pages, so it
+	// goes together with the blocks when they move
+	if (code_base != dram->base) {
+		code_base = dram->base;
+		code_pages.assign(dram->size / PAGE_SIZE + 1, 0);
+		blocks.clear();
+		page_blocks.clear();
+		links.clear();
+		jit.reset();
+	}
+
+	uint64_t page = (start - code_base) / PAGE_SIZE;
+
+	code_pages[page] = 1;
+	page_blocks[page].push_back(start);
+
+	return &(blocks[start] = std::move(block));
+}
+
+BlockCache::Block *BlockCache::lookup(uint64_t addr)
+{
+	if (stale || blocks.size() >= MAX_BLOCKS)
+		apply();
+
+	auto it = blocks.find(addr);
+	if (it != blocks.end())
+		return &it->second;
+
+	return build(addr);
+}
+
+void BlockCache::compile(Block& block)
+{
+	block.native = jit.compile(block.ops, block.addr, code_pages.data());
+
+	if (!block.native) {
+		if (jit.is_full())
+			flush();
+
+		return;
+	}
+
+	for (const Jit::Link& link : jit.get_links()) {
+		auto it = blocks.find(link.target);
+
+		if (it != blocks.end() && it->second.native)
+			Jit::link(link.slot, it->second.native);
+		else
+			links[link.target].push_back(link.slot);
+	}
+
+	auto it = links.find(block.addr);
+	if (it == links.end())
+		return;
+
+	for (uint64_t *slot : it->second)
+		Jit::link(slot, block.native);
+
+	links.erase(it);
+}
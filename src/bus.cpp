@@ -5,30 +5,131 @@
 
 using namespace Emulator;
 
-Device *Bus::get(uint64_t addr) const
+void Bus::map(void)
+{
+	regions.clear();
+
+	for (const std::unique_ptr<Device>& uptr_device : devices)
+		if (uptr_device)
+			regions.push_back({
+				uptr_device->base,
+				uptr_device->base + uptr_device->size,
+				uptr_device.get()
+			});
+
+	std::sort(regions.begin(), regions.end(),
+		[](const Region& lhs, const Region& rhs) {
+			return lhs.base < rhs.base;
+		}
+	);
+
+	dram = static_cast<Dram*>(get(DeviceName::DRAM));
+}
+
+// Device threads have no hart, the guest's fence.i
+// covers the code they write like for any other hart
+void Bus::invalidate(uint64_t addr)
+{
+	if (cpu)
+		cpu->block_cache.invalidate(addr);
+}
+
+void Bus::invalidate(uint64_t addr, uint64_t len)
+{
+	static constexpr uint64_t PAGE_SIZE = 4096;
+
+	if (!cpu)
+		return;
+
+	for (uint64_t page = addr & ~(PAGE_SIZE - 1); page < addr + len; page += PAGE_SIZE)
+		cpu->block_cache.invalidate(page);
+}
+
+bool Bus::read_span(uint64_t addr, void *dst, uint64_t len)
+{
+	uint8_t *bytes = static_cast<uint8_t*>(dst);
+
+	if (dram && dram->contains(addr, len)) {
+		dram->read_span(addr, bytes, len);
+		return true;
+	}
+
+	Device *device = get(addr);
+
+	if (!device || addr - device->base + len > device->size)
+		return false;
+
+	std::scoped_lock lock(mmio);
+	device->read_span(addr, bytes, len);
+
+	return true;
+}
+
+bool Bus::write_span(uint64_t addr, const void *src, uint64_t len)
 {
-	for (const std::unique_ptr<Device>& uptr_device : devices) {
-		Device *device = uptr_device.get();
-		if (!device)
-			continue;
+	const uint8_t *bytes = static_cast<const uint8_t*>(src);
 
-		if ((addr >= device->base) && (addr < (device->base + device->size)))
-			return device;
+	if (dram && dram->contains(addr, len)) {
+		dram->write_span(addr, bytes, len);
+		invalidate(addr, len);
+		return true;
 	}
 
-	return nullptr;
+	Device *device = get(addr);
+
+	if (!device || addr - device->base + len > device->size)
+		return false;
+
+	std::scoped_lock lock(mmio);
+	device->write_span(addr, bytes, len);
+
+	return true;
+}
+
+Device *Bus::get(uint64_t addr) const
+{
+	if (dram && addr - dram->base < dram->size)
+		return dram;
+
+	auto it = std::upper_bound(regions.begin(), regions.end(), addr,
+		[](uint64_t addr, const Region& region) {
+			return addr < region.base;
+		}
+	);
+
+	if (it == regions.begin() || addr >= (--it)->end)
+		return nullptr;
+
+	return it->device;
+}
+
+void Bus::tick(DeviceName name)
+{
+	Device *device = get(name);
+
+	if (device) {
+		std::scoped_lock lock(mmio);
+		device->tick();
+	}
 }
 
 uint64_t Bus::load(uint64_t addr, uint64_t len)
 {
 	Device *device = get(addr);
 	
-	if (device)
+	if (device) {
+		if (is_dram(device))
+			return device->load(addr, len);
+
+		std::scoped_lock lock(mmio);
 		return device->load(addr, len);
+	}
 	
-	cpu->set_exception(
-		Exception::LOAD_ACCESS_FAULT
-	);
+	if (cpu)
+		cpu->set_exception(
+			Exception::LOAD_ACCESS_FAULT
+		);
+
 	return 0;
 }
 
@@ -36,9 +137,16 @@ void Bus::store(uint64_t addr, uint64_t value, uint64_t len)
 {
 	Device *device = get(addr);
 	
-	if (device)
-		device->store(addr, value, len);
-	else
+	if (device) {
+		if (is_dram(device))
+			device->store(addr, value, len);
+		else {
+			std::scoped_lock lock(mmio);
+			device->store(addr, value, len);
+		}
+
+		invalidate(addr);
+	} else if (cpu)
 		cpu->set_exception(
 			Exception::STORE_ACCESS_FAULT
 		);
@@ -64,5 +172,5 @@ void Bus::dump(void) const
 }
 
 namespace Emulator {
-	std::unique_ptr<Bus> bus;
+	thread_local Bus *bus = nullptr;
 };
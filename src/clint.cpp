@@ -1,7 +1,10 @@
+#include <algorithm>
+#include <bit>
 #include "common.hpp"
 #include "errors.hpp"
 #include "registers.hpp"
 #include "cpu.hpp"
+#include "bus.hpp"
 #include "clint.hpp"
 
 using namespace Emulator;
@@ -12,26 +15,30 @@ uint64_t Clint::load(uint64_t addr, uint64_t len)
 	uint64_t off = 0;
 
 	if (addr >= MSIP_BASE &&
-		addr <= MSIP_BASE + MSIP_SIZE)
+		addr < MSIP_BASE + MSIP_SIZE * MAX_HARTS)
 	{
-		reg_value = msip;
-		off = addr - MSIP_BASE;
+		reg_value = msip[(addr - MSIP_BASE) / MSIP_SIZE];
+		off = (addr - MSIP_BASE) % MSIP_SIZE;
 	}
 	else if (addr >= MTIMECMP_BASE &&
-		addr <= MTIMECMP_BASE + MTIMECMP_SIZE)
+		addr < MTIMECMP_BASE + MTIMECMP_SIZE * MAX_HARTS)
 	{
-		reg_value = mtimecmp;
-		off = addr - MTIMECMP_BASE;
+		reg_value = mtimecmp[(addr - MTIMECMP_BASE) / MTIMECMP_SIZE];
+		off = (addr - MTIMECMP_BASE) % MTIMECMP_SIZE;
 	}
 	else if (addr >= MTIME_BASE &&
-		addr <= MTIME_BASE + MTIME_SIZE)
+		addr < MTIME_BASE + MTIME_SIZE)
 	{
 		reg_value = mtime;
 		off = addr - MTIME_BASE;
 	}
 
-	return (reg_value >> (off * 8ULL)) & 
-		((1ULL << len) - 1ULL);
+	reg_value >>= off * 8ULL;
+
+	if (len != 64)
+		reg_value &= (1ULL << len) - 1ULL;
+
+	return reg_value;
 }
 
 void Clint::store(uint64_t addr, uint64_t value, uint64_t len)
@@ -40,19 +47,19 @@ void Clint::store(uint64_t addr, uint64_t value, uint64_t len)
 	uint64_t off = 0;
 
 	if (addr >= MSIP_BASE &&
-		addr <= MSIP_BASE + MSIP_SIZE)
+		addr < MSIP_BASE + MSIP_SIZE * MAX_HARTS)
 	{
-		reg_value = msip;
-		off = addr - MSIP_BASE;
+		reg_value = msip[(addr - MSIP_BASE) / MSIP_SIZE];
+		off = (addr - MSIP_BASE) % MSIP_SIZE;
 	}
 	else if (addr >= MTIMECMP_BASE &&
-		addr <= MTIMECMP_BASE + MTIMECMP_SIZE)
+		addr < MTIMECMP_BASE + MTIMECMP_SIZE * MAX_HARTS)
 	{
-		reg_value = mtimecmp;
-		off = addr - MTIMECMP_BASE;
+		reg_value = mtimecmp[(addr - MTIMECMP_BASE) / MTIMECMP_SIZE];
+		off = (addr - MTIMECMP_BASE) % MTIMECMP_SIZE;
 	}
 	else if (addr >= MTIME_BASE &&
-		addr <= MTIME_BASE + MTIME_SIZE)
+		addr < MTIME_BASE + MTIME_SIZE)
 	{
 		reg_value = mtime;
 		off = addr - MTIME_BASE;
@@ -61,27 +68,33 @@ void Clint::store(uint64_t addr, uint64_t value, uint64_t len)
 	if (len != 64) {
 		uint64_t mask = (1ULL << len) - 1ULL;
 
-		reg_value &= ~(mask << (len * 8));
+		reg_value &= ~(mask << (off * 8));
 		reg_value |= (value & mask) << (off * 8);
 	} else {
 		reg_value = value;
 	}
 
 	if (addr >= MSIP_BASE &&
-		addr <= MSIP_BASE + MSIP_SIZE)
+		addr < MSIP_BASE + MSIP_SIZE * MAX_HARTS)
 	{
-		msip = reg_value;
+		msip[(addr - MSIP_BASE) / MSIP_SIZE] = reg_value;
+		publish((addr - MSIP_BASE) / MSIP_SIZE);
+		bus->wakeups.wake((addr - MSIP_BASE) / MSIP_SIZE);
 	}
 	else if (addr >= MTIMECMP_BASE &&
-		addr <= MTIMECMP_BASE + MTIMECMP_SIZE)
+		addr < MTIMECMP_BASE + MTIMECMP_SIZE * MAX_HARTS)
 	{
-		mtimecmp = reg_value;
+		mtimecmp[(addr - MTIMECMP_BASE) / MTIMECMP_SIZE] = reg_value;
+		publish((addr - MTIMECMP_BASE) / MTIMECMP_SIZE);
+		bus->wakeups.wake((addr - MTIMECMP_BASE) / MTIMECMP_SIZE);
 	}
 	else if (addr >= MTIME_BASE &&
-		addr <= MTIME_BASE + MTIME_SIZE)
+		addr < MTIME_BASE + MTIME_SIZE)
 	{
 		mtime = reg_value;
 	}
+
+	tick();
 }
 
 void Clint::dump(void) const
@@ -92,8 +105,8 @@ void Clint::dump(void) const
 		"################################"
 		"\n# base: ", base,
 		"\n# size: ", size,
-		"\n# msip: ", msip,
-		"\n# mtimecmp: ", mtimecmp,
+		"\n# msip: ", msip[0],
+		"\n# mtimecmp: ", mtimecmp[0],
 		"\n# mtime: ", mtime,
 		"\n################################"
 	);
@@ -101,32 +114,77 @@ void Clint::dump(void) const
 
 void Clint::tick(void)
 {
-	mtime = get_milliseconds() * 1000;
+	uint64_t hartid = cpu->hartid;
+
+	cpu->scheduler.schedule(DeviceName::CLINT, TICK_PERIOD);
+
+	if (is_virtual()) {
+		uint64_t now = (
+			cpu->csr_regs.load(CRegs::Address::CYCLE) >> icount
+		) + offset[hartid];
+
+		if (now < mtime) {
+			offset[hartid] += mtime - now;
+			now = mtime;
+		}
+
+		mtime = now;
+	} else
+		mtime = get_milliseconds() * 1000;
+
 	cpu->csr_regs.store(CRegs::Address::TIME, mtime);
+	cpu->mtimecmp = mtimecmp[hartid];
+
+	// mtime is shared, it may have crossed any hart's mtimecmp
+	for (uint64_t h = 0; h < harts; h++)
+		publish(h);
+}
+
+void Clint::publish(uint64_t hartid)
+{
+	uint64_t bit = 1ULL << hartid;
+
+	if (msip[hartid] & 1)
+		software.fetch_or(bit, std::memory_order_relaxed);
+	else
+		software.fetch_and(~bit, std::memory_order_relaxed);
 
-	if (msip & 1)
-		cpu->csr_regs.store(
-			CRegs::Address::MIP,
-			write_bit(
-				cpu->csr_regs.load(CRegs::Address::MIP), 
-				CRegs::Mask::MSIP_BIT, 1
-			)
-		);
-
-	if (mtime >= mtimecmp)
-		cpu->csr_regs.store(
-			CRegs::Address::MIP,
-			write_bit(
-				cpu->csr_regs.load(CRegs::Address::MIP), 
-				CRegs::Mask::MTIP_BIT, 1
-			)
-		);
+	if (mtime >= mtimecmp[hartid])
+		timer.fetch_or(bit, std::memory_order_relaxed);
 	else
-		cpu->csr_regs.store(
-			CRegs::Address::MIP,
-			write_bit(
-				cpu->csr_regs.load(CRegs::Address::MIP), 
-				CRegs::Mask::MTIP_BIT, 0
-			)
-		);
+		timer.fetch_and(~bit, std::memory_order_relaxed);
+}
+
+bool Clint::idle(uint64_t hartid, bool timer)
+{
+	sleeping |= 1ULL << hartid;
+	armed = write_bit(armed, hartid, timer);
+
+	if (static_cast<uint64_t>(std::popcount(sleeping)) < harts)
+		return false;
+
+	uint64_t target = ~0ULL;
+
+	for (uint64_t h = 0; h < harts; h++)
+		if ((armed >> h) & 1)
+			target = std::min(target, mtimecmp[h]);
+
+	if (target == ~0ULL)
+		return false;
+
+	mtime = std::max(mtime, target);
+
+	for (uint64_t h = 0; h < harts; h++)
+		publish(h);
+
+	for (uint64_t h = 0; h < harts; h++)
+		if (h != hartid && ((armed >> h) & 1) && mtime >= mtimecmp[h])
+			bus->wakeups.wake(h);
+
+	return true;
+}
+
+void Clint::resume(uint64_t hartid)
+{
+	sleeping &= ~(1ULL << hartid);
 }
@@ -1,12 +1,11 @@
 #include <bit>
 #include <csignal>
-#include "clint.hpp"
-#include "gpu.hpp"
-#include "virtio.hpp"
 #include "cpu.hpp"
 #include "mmu.hpp"
 #include "decoder.hpp"
 #include "instruction.hpp"
+#include "bus.hpp"
+#include "clint.hpp"
 
 using namespace Emulator;
 
@@ -48,33 +47,40 @@ void Cpu::dump_regs(void)
 	);
 }
 
-void Cpu::iterate(void)
+void Cpu::dump_stats(void)
 {
-	csr_regs.store(
-		CRegs::Address::CYCLE,
-		csr_regs.load(
-			CRegs::Address::CYCLE
-		) + 1
-	);
+	static constexpr std::array<std::string_view, Instruction::Fusion::SIZE> names = {
+		"lui+addi", "auipc+addi", "auipc+jalr",
+		"slli+srli", "c.li+branch", "c.mv+branch"
+	};
 
-#ifndef EMU_DEBUG
-	Clint *clint = static_cast<Clint*>(
-		bus->get(DeviceName::CLINT)
-	);
-	if (clint)
-		clint->tick();
-	
-	Gpu *gpu = static_cast<Gpu*>(
-		bus->get(DeviceName::GPU)
+	uint64_t fused = 0;
+	for (uint64_t count : stats.fused)
+		fused += count;
+
+	uint64_t retired = csr_regs.load(CRegs::Address::CYCLE);
+
+	error<INFO>(
+		"################################\n"
+		"#  Statistics                  #\n"
+		"################################"
+		"\n# hart: ", std::dec, hartid,
+		"\n# retired: ", retired,
+		"\n# fused pairs: ", fused, " (",
+		retired ? fused * 2 * 100 / retired : 0, "% of retired)"
 	);
-	if (gpu)
-		gpu->tick();
+
+	for (uint64_t i = 0; i < Instruction::Fusion::SIZE; i++)
+		error<INFO>("# ", names[i], ": ", std::dec, stats.fused[i]);
 	
-	Virtio *virtio = static_cast<Virtio*>(
-		bus->get(DeviceName::VIRTIO)
-	);
-	if (virtio)
-		virtio->tick();
+	error<INFO>("################################\n");
+}
+
+void Cpu::iterate(void)
+{
+#ifndef EMU_DEBUG
+	if (scheduler.expired(csr_regs.load(CRegs::Address::CYCLE)))
+		scheduler.run();
 #endif
 	interrupt.get_pending();
 
@@ -91,36 +97,159 @@ void Cpu::iterate(void)
 		interrupt.process();
 	}
 
-	uint32_t insn_size = _iterate();
+	if (sleep) {
+		idle();
+		return;
+	}
+
+#ifndef EMU_SWITCH_DISPATCH
+	uint64_t addr = mmu->translate_fetch(pc);
+
+	if (exception.current == Exception::NONE) {
+		BlockCache::Block *block = block_cache.lookup(addr);
+
+		if (block) {
+			execute_block(*block);
+			return;
+		}
+	}
+#endif
+
+	csr_regs.store(
+		CRegs::Address::CYCLE,
+		csr_regs.load(
+			CRegs::Address::CYCLE
+		) + 1
+	);
+
+	uint32_t insn_size = 4;
+	
+	if (exception.current == Exception::NONE)
+		insn_size = _iterate();
 
 	if (exception.current != Exception::NONE) {
-	#ifdef EMU_DEBUG
-		error<INFO>(
-			"################################\n"
-			"# Exception                    #\n"
-			"################################"
-			"\n# current: ", exception.get_name(),
-			"\n# value: ", exception.value,
-			"\n################################\n"
-		);
-	#endif
-		exception.process();
-	#ifndef EMU_DEBUG
-		clear_exception();
-	#endif
+		handle_exception();
 		return;
 	}
 	
 	pc += insn_size;
 }
 
+void Cpu::execute_block(BlockCache::Block& block)
+{
+	const Instruction::Op& op = block.ops.front();
+#ifdef EMU_DEBUG
+	csr_regs.store(
+		CRegs::Address::CYCLE,
+		csr_regs.load(
+			CRegs::Address::CYCLE
+		) + op.count
+	);
+
+	int_regs[IRegs::zero] = 0;
+
+	error<INFO>(
+		"################################\n"
+		"# At Address ", pc,
+		"\n################################"
+	);
+
+	Decoder(op.insn).dump();
+
+	op.exec(op);
+
+	if (exception.current == Exception::NONE)
+		pc += op.size;
+#else
+	if (!block.native && ++block.hits == Jit::HOT_THRESHOLD)
+		block_cache.compile(block);
+
+	if (block.native)
+		csr_regs.store(
+			CRegs::Address::CYCLE,
+			csr_regs.load(
+				CRegs::Address::CYCLE
+			) + block.native()
+		);
+	else
+		op.run(op);
+#endif
+	if (exception.current != Exception::NONE)
+		handle_exception();
+}
+
+void Cpu::idle(void)
+{
+	static constexpr uint64_t IDLE_SLICE = 10000;
+	static constexpr uint64_t WAKEUP = 
+		CRegs::Mask::MSIP | CRegs::Mask::MTIP |
+		CRegs::Mask::MEIP | CRegs::Mask::SEIP;
+
+	uint64_t enabled = csr_regs.load(CRegs::Address::MIE);
+
+	// WFI is a nop when nothing outside the hart could wake it
+	if (!(enabled & WAKEUP) || 
+		(csr_regs.load(CRegs::Address::MIP) & enabled))
+	{
+		sleep = false;
+		return;
+	}
+
+#ifdef EMU_DEBUG
+	sleep = false;
+#else
+	Clint *clint = static_cast<Clint*>(bus->get(DeviceName::CLINT));
+	uint64_t timeout = IDLE_SLICE;
+
+	if (clint && clint->is_virtual()) {
+		auto guard = bus->lock();
+
+		// Time only moves while some hart retires instructions
+		if (clint->idle(hartid, enabled & CRegs::Mask::MTIP))
+			timeout = 0;
+	} else if (enabled & CRegs::Mask::MTIP) {
+		uint64_t now = get_milliseconds() * 1000;
+		timeout = std::min(timeout, mtimecmp > now ? mtimecmp - now : 0);
+	}
+
+	if (timeout)
+		bus->wakeups.wait(hartid, std::chrono::microseconds(timeout));
+
+	if (clint && clint->is_virtual()) {
+		auto guard = bus->lock();
+		clint->resume(hartid);
+	}
+
+	scheduler.advance();
+
+	// Whatever ran first above, the CLINT sees a warped
+	// or elapsed mtime before the hart checks MIP again
+	bus->tick(DeviceName::CLINT);
+#endif
+}
+
+void Cpu::handle_exception(void)
+{
+#ifdef EMU_DEBUG
+	error<INFO>(
+		"################################\n"
+		"# Exception                    #\n"
+		"################################"
+		"\n# current: ", exception.get_name(),
+		"\n# value: ", exception.value,
+		"\n################################\n"
+	);
+#endif
+	exception.process();
+#ifndef EMU_DEBUG
+	clear_exception();
+#endif
+}
+
 uint32_t Cpu::_iterate(void)
 {
 	int_regs[IRegs::zero] = 0;
 
-	if (sleep)
-		return 0;
-	
 	uint32_t insn = mmu->fetch(pc);
 
 	if (exception.current != Exception::NONE)
@@ -148,5 +277,5 @@ uint32_t Cpu::_iterate(void)
 }
 
 namespace Emulator {
-	std::unique_ptr<Cpu> cpu;
+	thread_local Cpu *cpu = nullptr;
 };
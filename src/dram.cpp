@@ -1,44 +1,221 @@
 #include <algorithm>
+#include <cstdlib>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#elif defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
 #include <dram.hpp>
 
 using namespace Emulator;
 
-Dram::Dram(uint64_t _base, uint64_t _size, std::vector<uint8_t> _data) :
+static constexpr uint64_t HUGE_PAGE = BYTE_SIZE<MIB>(2);
+
+Dram::Dram(uint64_t _base, uint64_t _size, Backing backing) :
 	Device(_base, _size)
 {
-	data.resize(_size);
+	map(backing);
 
-	if (_data.size())
-		std::memcpy(data.data(), _data.data(), _data.size());
+	if (backing.numa_node >= 0)
+		bind(backing.numa_node);
 }
 
-void Dram::copy(std::vector<uint8_t>& img, uint64_t off)
+Dram::Dram(uint64_t _base, uint64_t _size, 
+	const std::vector<uint8_t>& _data, Backing backing) :
+	Dram(_base, _size, backing)
 {
-	std::memcpy(data.data() + off, img.data(), img.size());
+	std::memcpy(data, _data.data(), std::min<uint64_t>(_data.size(), _size));
 }
 
-uint64_t Dram::load(uint64_t addr, uint64_t len)
+Dram::~Dram()
+{
+	if (!data)
+		return;
+
+#ifdef __linux__
+	munmap(data, mapped);
+#elif defined(_WIN32)
+	VirtualFree(data, 0, MEM_RELEASE);
+#else
+	std::free(data);
+#endif
+}
+
+#ifdef __linux__
+void Dram::map(const Backing& backing)
+{
+	mapped = align_up(size, HUGE_PAGE);
+
+	if (backing.hugetlb) {
+		void *ptr = mmap(
+			nullptr, mapped, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+			-1, 0
+		);
+
+		if (ptr != MAP_FAILED) {
+			data = static_cast<uint8_t*>(ptr);
+			return;
+		}
+
+		error<WARN>(
+			"could not map guest RAM with hugetlbfs pages,\n"
+			"falling back to transparent hugepages\n"
+		);
+	}
+
+	// Over-allocate to put RAM on a huge page boundary, so that
+	// guest 2 MiB pages line up with the host transparent ones
+	uint64_t len = mapped + HUGE_PAGE;
+
+	void *ptr = mmap(
+		nullptr, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		-1, 0
+	);
+
+	if (ptr == MAP_FAILED)
+		error<FAIL>("could not map ", size, " bytes of guest RAM\n");
+
+	uint8_t *start = static_cast<uint8_t*>(ptr);
+	data = reinterpret_cast<uint8_t*>(
+		align_up(reinterpret_cast<uintptr_t>(start), HUGE_PAGE)
+	);
+
+	if (data != start)
+		munmap(start, data - start);
+
+	if (start + len != data + mapped)
+		munmap(data + mapped, (start + len) - (data + mapped));
+
+	madvise(data, mapped, MADV_HUGEPAGE);
+}
+
+void Dram::bind(int64_t numa_node)
+{
+	static constexpr uint64_t BITS = sizeof(unsigned long) * 8;
+
+	std::vector<unsigned long> nodemask(numa_node / BITS + 1);
+	nodemask[numa_node / BITS] |= 1UL << (numa_node % BITS);
+
+	if (syscall(SYS_mbind, data, mapped, MPOL_BIND,
+		nodemask.data(), nodemask.size() * BITS + 1, 0))
+	{
+		error<WARN>("could not bind guest RAM to NUMA node ", numa_node, "\n");
+	}
+}
+#else
+void Dram::map(const Backing& backing)
+{
+	mapped = size;
+
+	if (backing.hugetlb)
+		error<WARN>("hugetlbfs pages are only supported on Linux\n");
+
+#ifdef _WIN32
+	// Committed pages read as zero and are only
+	// backed once the guest first touches them
+	data = static_cast<uint8_t*>(VirtualAlloc(
+		nullptr, mapped, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE
+	));
+#else
+	data = static_cast<uint8_t*>(std::calloc(mapped, 1));
+#endif
+
+	if (!data)
+		error<FAIL>("could not allocate ", size, " bytes of guest RAM\n");
+}
+
+void Dram::bind(int64_t numa_node)
+{
+	error<WARN>("NUMA binding is only supported on Linux, ignoring node ", numa_node, "\n");
+}
+#endif
+
+void Dram::copy(const std::vector<uint8_t>& img, uint64_t off)
 {
-    addr -= base;
+	if (off > size || img.size() > size - off)
+		error<FAIL>("image of ", img.size(), " bytes does not fit in guest RAM\n");
+
+	std::memcpy(data + off, img.data(), img.size());
+}
+
+void Dram::load_image(const std::string& path, uint64_t off)
+{
+#ifdef __linux__
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		error<FAIL>("could not open ", path, "\n");
+
+	struct stat st;
+	if (fstat(fd, &st)) {
+		close(fd);
+		error<FAIL>("could not stat ", path, "\n");
+	}
 
-    switch (len) {
-	case 8: return data[addr];
-	case 16: return *reinterpret_cast<uint16_t*>(data.data() + addr);
-	case 32: return *reinterpret_cast<uint32_t*>(data.data() + addr);
-	case 64: return *reinterpret_cast<uint64_t*>(data.data() + addr);
+	uint64_t len = st.st_size;
+
+	if (off > size || len > size - off) {
+		close(fd);
+		error<FAIL>(path, " does not fit in guest RAM\n");
+	}
+
+	static const uint64_t page = sysconf(_SC_PAGESIZE);
+	uint8_t *dest = data + off;
+
+	// Shares the page cache until the guest writes, the tail of
+	// the last page past the end of file reads as 0. Where the RAM
+	// mapping cannot be split (hugetlbfs) the image is read instead
+	if (len && reinterpret_cast<uintptr_t>(dest) % page == 0 &&
+		mmap(dest, align_up(len, page), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED)
+	{
+		close(fd);
+		return;
+	}
+
+	for (uint64_t done = 0; done < len;) {
+		ssize_t count = pread(fd, dest + done, len - done, done);
+
+		if (count <= 0) {
+			close(fd);
+			error<FAIL>("could not read ", path, "\n");
+		}
+
+		done += count;
+	}
+
+	close(fd);
+#else
+	copy(load_file(path), off);
+#endif
+}
+
+uint64_t Dram::load(uint64_t addr, uint64_t len)
+{
+	switch (len) {
+	case 8: return load<8>(addr);
+	case 16: return load<16>(addr);
+	case 32: return load<32>(addr);
+	case 64: return load<64>(addr);
 	default: return 0;
 	}
 }
 
 void Dram::store(uint64_t addr, uint64_t value, uint64_t len)
 {
-    addr -= base;
-    
-    switch (len) {
-	case 8:  data[addr] = value; break;
-	case 16: *reinterpret_cast<uint16_t*>(data.data() + addr) = value; break;
-	case 32: *reinterpret_cast<uint32_t*>(data.data() + addr) = value; break;
-	case 64: *reinterpret_cast<uint64_t*>(data.data() + addr) = value; break;
+	switch (len) {
+	case 8: store<8>(addr, value); break;
+	case 16: store<16>(addr, value); break;
+	case 32: store<32>(addr, value); break;
+	case 64: store<64>(addr, value); break;
 	default: break;
 	}
 }
@@ -1,6 +1,9 @@
 #include <filesystem>
 #include <fstream>
+#include <cctype>
+#include <cstdlib>
 #include <cstring>
+#include <cstdio>
 #include <string>
 #include <getopt.h>
 #include "common.hpp"
@@ -15,34 +18,186 @@
 #include "syscon.hpp"
 #include "virtio.hpp"
 #include "settings.hpp"
+#include "fdt.hpp"
 
 using namespace Emulator;
 
-static bool patch_dtb_ram_size(
-	std::vector<uint8_t>& dtb_data, 
-	uint32_t ram_size)
+static bool patch_dtb_memory(
+	std::vector<uint8_t>& dtb_data,
+	uint64_t base, uint64_t size)
 {
-	static constexpr std::array<uint8_t, 4> pattern = {
-		0x0b, 0xad, 0xc0, 0xde
-	};
+	Fdt fdt;
 
-	auto it = std::search(
-		dtb_data.begin(), dtb_data.end(),
-		pattern.begin(), pattern.end(),
-		[](uint8_t a, uint8_t b) {return a == b;}
-	);
+	if (!fdt.load(dtb_data))
+		return false;
 
-	if (it == dtb_data.end())
+	uint32_t addr_cells = 2;
+	uint32_t size_cells = 1;
+	std::vector<uint8_t> *value = fdt.root.prop("#address-cells");
+
+	if (value && !Fdt::cell(*value, 0, addr_cells))
 		return false;
-	
-	uint32_t ram_size_be = (
-		((ram_size & 0xff000000U) >> 24U) |
-		((ram_size & 0x00ff0000U) >> 8U) |
-		((ram_size & 0x0000ff00U) << 8U) |
-		((ram_size & 0x000000ffU) << 24U)
-	);
 
-	std::memcpy(&*it, &ram_size_be, 4);
+	value = fdt.root.prop("#size-cells");
+
+	if (value && !Fdt::cell(*value, 0, size_cells))
+		return false;
+
+	if (addr_cells < 1 || addr_cells > 2 || size_cells < 1 || size_cells > 2)
+		return false;
+
+	// A single cell cannot describe RAM past 4 GiB
+	if ((addr_cells == 1 && (base >> 32U)) || (size_cells == 1 && (size >> 32U)))
+		return false;
+
+	Fdt::Node *memory = nullptr;
+
+	for (Fdt::Node& node : fdt.root.children)
+		if (node.name == "memory" || node.name.starts_with("memory@")) {
+			memory = &node;
+			break;
+		}
+
+	if (!memory)
+		return false;
+
+	std::vector<uint32_t> reg;
+
+	if (addr_cells == 2)
+		reg.push_back(base >> 32U);
+	reg.push_back(base);
+
+	if (size_cells == 2)
+		reg.push_back(size >> 32U);
+	reg.push_back(size);
+
+	memory->set("reg", reg);
+
+	dtb_data = fdt.save();
+
+	return true;
+}
+
+static uint32_t max_phandle(Fdt::Node& node)
+{
+	uint32_t phandle = 0;
+	std::vector<uint8_t> *value = node.prop("phandle");
+
+	if (value && value->size() == 4)
+		Fdt::cell(*value, 0, phandle);
+
+	for (Fdt::Node& child : node.children)
+		phandle = std::max(phandle, max_phandle(child));
+
+	return phandle;
+}
+
+static void extend_interrupts(Fdt::Node& node, uint32_t intc,
+	uint64_t intc_cells, const std::vector<uint32_t>& intcs)
+{
+	std::vector<uint8_t> *value = node.prop("interrupts-extended");
+
+	if (value) {
+		std::vector<uint32_t> boot;
+		std::vector<uint32_t> extended;
+		uint64_t stride = 1 + intc_cells;
+
+		uint32_t cell;
+
+		for (uint64_t i = 0; i + stride <= value->size() / 4; i += stride)
+			for (uint64_t j = 0; j < stride; j++)
+				if (Fdt::cell(*value, i + j, cell))
+					extended.push_back(cell);
+
+		for (uint64_t i = 0; i < extended.size(); i += stride)
+			if (extended[i] == intc)
+				boot.insert(
+					boot.end(),
+					extended.begin() + i,
+					extended.begin() + i + stride
+				);
+
+		for (uint32_t phandle : intcs)
+			for (uint64_t i = 0; i < boot.size(); i += stride) {
+				extended.push_back(phandle);
+				extended.insert(
+					extended.end(),
+					boot.begin() + i + 1,
+					boot.begin() + i + stride
+				);
+			}
+
+		node.set("interrupts-extended", extended);
+	}
+
+	for (Fdt::Node& child : node.children)
+		extend_interrupts(child, intc, intc_cells, intcs);
+}
+
+static bool patch_dtb_harts(
+	std::vector<uint8_t>& dtb_data,
+	uint64_t harts)
+{
+	Fdt fdt;
+
+	if (!fdt.load(dtb_data))
+		return false;
+
+	Fdt::Node *cpus = fdt.root.child("cpus");
+	if (!cpus)
+		return false;
+
+	Fdt::Node *cpu0 = cpus->child("cpu@0");
+	if (!cpu0)
+		return false;
+
+	Fdt::Node *intc0 = cpu0->child("interrupt-controller");
+	if (!intc0 || !intc0->prop("phandle"))
+		return false;
+
+	uint32_t intc;
+	uint32_t intc_cells = 1;
+
+	if (!Fdt::cell(*intc0->prop("phandle"), 0, intc))
+		return false;
+
+	std::vector<uint8_t> *value = intc0->prop("#interrupt-cells");
+
+	if (value && !Fdt::cell(*value, 0, intc_cells))
+		return false;
+
+	uint32_t phandle = max_phandle(fdt.root);
+	Fdt::Node boot = *cpu0;
+	Fdt::Node *cluster = nullptr;
+	std::vector<uint32_t> intcs;
+
+	if (cpus->child("cpu-map"))
+		cluster = cpus->child("cpu-map")->child("cluster0");
+
+	for (uint64_t hartid = 1; hartid < harts; hartid++) {
+		Fdt::Node hart = boot;
+		char name[32];
+
+		std::snprintf(name, sizeof(name), "cpu@%x", static_cast<uint32_t>(hartid));
+		hart.name = name;
+		hart.set("reg", {static_cast<uint32_t>(hartid)});
+		hart.set("phandle", {++phandle});
+		hart.child("interrupt-controller")->set("phandle", {++phandle});
+
+		intcs.push_back(phandle);
+
+		if (cluster) {
+			std::snprintf(name, sizeof(name), "core%u", static_cast<uint32_t>(hartid));
+			cluster->children.push_back({name, {}, {}});
+			cluster->children.back().set("cpu", {phandle - 1});
+		}
+
+		cpus->children.push_back(std::move(hart));
+	}
+
+	extend_interrupts(fdt.root, intc, intc_cells, intcs);
+
+	dtb_data = fdt.save();
 
 	return true;
 }
@@ -53,8 +208,12 @@ Emulator::Emulator::Emulator(int argc, char *argv[])
 	std::string dtb_p = "";
 	std::string kernel_p = "";
 	std::string virt_drive_p = "";
+	bool read_only = false;
 
 	uint64_t ram_size = RAM_SIZE;
+	uint64_t harts = 1;
+	uint64_t icount = Clint::WALL_CLOCK;
+	Dram::Backing backing;
 
 	static constexpr option long_options[] = {
 		{"bios", required_argument, nullptr, 'b'},
@@ -62,13 +221,18 @@ Emulator::Emulator::Emulator(int argc, char *argv[])
 		{"kernel", required_argument, nullptr, 'k'},
 		{"ram_size", required_argument, nullptr, 'r'},
 		{"virtual_drive", required_argument, nullptr, 'v'},
+		{"read_only", no_argument, nullptr, 'R'},
+		{"harts", required_argument, nullptr, 'n'},
+		{"icount", required_argument, nullptr, 'i'},
+		{"hugetlb", no_argument, nullptr, 'H'},
+		{"numa", required_argument, nullptr, 'N'},
 		{"help", no_argument, nullptr, 'h'}
 	};
 	
 	int opt = 0;
 	int opt_idx = 0;
 
-	while ((opt = getopt_long(argc, argv, "b:d:k:r:v:h:", 
+	while ((opt = getopt_long(argc, argv, "b:d:k:r:v:Rn:i:HN:h:", 
 							long_options, &opt_idx)
 	) != -1) {
 		switch (opt) {
@@ -82,11 +246,36 @@ Emulator::Emulator::Emulator(int argc, char *argv[])
 			kernel_p = optarg;
 			break;
 		case 'r':
-			ram_size = BYTE_SIZE<MIB>(atoi(optarg));
+			ram_size = BYTE_SIZE<MIB>(std::strtoull(optarg, nullptr, 10));
 			break;
 		case 'v':
 			virt_drive_p = optarg;
 			break;
+		case 'R':
+			read_only = true;
+			break;
+		case 'n':
+			harts = atoi(optarg);
+			break;
+		case 'i':
+		{
+			char *end = nullptr;
+
+			icount = std::strtoul(optarg, &end, 10);
+
+			if (!std::isdigit(static_cast<unsigned char>(optarg[0])) || 
+				*end || icount > 32)
+			{
+				error<FAIL>("icount shift must be between 0 and 32\n");
+			}
+			break;
+		}
+		case 'H':
+			backing.hugetlb = true;
+			break;
+		case 'N':
+			backing.numa_node = atoi(optarg);
+			break;
 		case 'h':
 		default:
 			error<FAIL>(
@@ -95,8 +284,13 @@ Emulator::Emulator::Emulator(int argc, char *argv[])
 				"  -b, --bios			Path to the BIOS file (required)\n"
 				"  -d, --dtb			Path to the DTB file (required if kernel provided)\n"
 				"  -k, --kernel			Path to the kernel file\n"
-				"  -r, --ram_size		Size of RAM to use in MiB (default 64 MiB)\n"
+				"  -r, --ram_size		Size of RAM to use in MiB, allocated on first touch (default 64 MiB)\n"
 				"  -v, --virtual_drive	Path to the virtual disk image\n"
+				"  -R, --read_only		Attach the virtual disk read-only\n"
+				"  -n, --harts			Number of harts, each on its own thread (default 1)\n"
+				"  -i, --icount		Advance time by 1us every 2^N instructions instead of the host clock\n"
+				"  -H, --hugetlb		Back RAM with hugetlbfs pages (default transparent hugepages)\n"
+				"  -N, --numa			Bind RAM to the given host NUMA node\n"
 				"  -h, --help			This help message\n"
 			);
 			break;
@@ -112,34 +306,44 @@ Emulator::Emulator::Emulator(int argc, char *argv[])
 	if (!std::filesystem::exists(bios_p))
 		error<FAIL>("bios path invalid\n");
 
+	if (!ram_size)
+		error<FAIL>("ram size must be at least 1 MiB\n");
+
+	if (harts < 1 || harts > MAX_HARTS)
+		error<FAIL>("number of harts must be between 1 and ", MAX_HARTS, "\n");
+
+	machine = std::make_unique<Machine>(harts);
+
 	uint64_t ram_size_dtb = ram_size;
 
 	if (dtb_p.size())
 		ram_size_dtb += BYTE_SIZE<MIB>(2);
 		
-	cpu = std::make_unique<Cpu>();
-	mmu = std::make_unique<Mmu>();
-	bus = std::make_unique<Bus>();
-
-	cpu->int_regs[IRegs::sp] = DRAM_BASE + ram_size_dtb;
+	for (Machine::Hart& hart : machine->harts) {
+		hart.cpu->int_regs[IRegs::a0] = hart.cpu->hartid;
+		hart.cpu->int_regs[IRegs::sp] = DRAM_BASE + ram_size_dtb;
+	}
 		
 	bus->add<Dram, DeviceName::DRAM>(
 		DRAM_BASE,
 		ram_size_dtb,
-		std::move(load_file(bios_p))
+		backing
+	);
+
+	Dram *dram = static_cast<Dram*>(
+		bus->get(DeviceName::DRAM)
 	);
+	dram->load_image(bios_p, 0);
 
 	bus->add<Plic, DeviceName::PLIC>();
-	bus->add<Clint, DeviceName::CLINT>();
+	bus->add<Clint, DeviceName::CLINT>(harts, icount);
 	bus->add<Gpu, DeviceName::GPU>(960, 540);
 	
 	if (virt_drive_p.size()) {
 		if (!std::filesystem::exists(virt_drive_p))
 			error<FAIL>("virt_drive path invalid\n");
 
-		bus->add<Virtio, DeviceName::VIRTIO>(
-			std::move(load_file(virt_drive_p))
-		);
+		bus->add<Virtio, DeviceName::VIRTIO>(virt_drive_p, read_only);
 	}
 
 	bus->add<Syscon, DeviceName::SYSCON>();
@@ -149,38 +353,35 @@ Emulator::Emulator::Emulator(int argc, char *argv[])
 			error<FAIL>("dtb path invalid\n");
 
 		std::vector<uint8_t> dtb = load_file(dtb_p);
-		cpu->int_regs[IRegs::a1] = DRAM_BASE + ram_size;
+
+		for (Machine::Hart& hart : machine->harts)
+			hart.cpu->int_regs[IRegs::a1] = DRAM_BASE + ram_size;
 	
-		if (!patch_dtb_ram_size(dtb, ram_size))
+		if (harts > 1 && !patch_dtb_harts(dtb, harts))
 			error<WARN>(
-				"could not find device tree binary\n"
-				"memory size magic value (0x0badc0de),\n"
-				"make sure that the amount of memory\n"
-				"that the emulator allocates is equal\n"
-				"or greater than specified in the dtb\n"
+				"could not add the secondary harts to the\n"
+				"device tree binary, make sure that it has\n"
+				"a /cpus/cpu@0 node with an interrupt-controller\n"
 			);
-		
-		Dram *dram = static_cast<Dram*>(
-			bus->get(DeviceName::DRAM)
-		);
-		if (dram)
-			dram->copy(dtb, ram_size);
+
+		if (!patch_dtb_memory(dtb, DRAM_BASE, ram_size))
+			error<WARN>(
+				"could not patch the device tree binary\n"
+				"memory node, make sure that it exists and\n"
+				"that the root #address-cells and #size-cells\n"
+				"can hold the RAM base and size, otherwise\n"
+				"the guest sees the size written in the dtb\n"
+			);
+
+		dram->copy(dtb, ram_size);
 	}
 
 	if (kernel_p.size()) {
 		if (!std::filesystem::exists(kernel_p))
 			error<FAIL>("kernel path invalid\n");
 
-		std::vector<uint8_t> kernel = load_file(kernel_p);
-		
-		Dram *dram = static_cast<Dram*>(
-			bus->get(DeviceName::DRAM)
-		);
-		if (dram)
-			dram->copy(kernel, KERNEL_OFFSET);
+		dram->load_image(kernel_p, KERNEL_OFFSET);
 	}
 	
-	while (true) {
-		cpu->iterate();
-	}
+	machine->run();
 }
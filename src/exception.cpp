@@ -1,5 +1,6 @@
 #include "common.hpp"
 #include "cpu.hpp"
+#include "mmu.hpp"
 #include "registers.hpp"
 #include "exception.hpp"
 
@@ -113,4 +114,6 @@ void Exception::process(void)
             )
         );
     }
+
+    mmu->update();
 }
@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include "fdt.hpp"
+
+using namespace Emulator;
+
+namespace {
+
+struct Token {
+	enum : uint32_t {
+		BEGIN_NODE = 0x1,
+		END_NODE = 0x2,
+		PROP = 0x3,
+		NOP = 0x4,
+		END = 0x9
+	};
+};
+
+static constexpr uint32_t MAGIC = 0xd00dfeed;
+static constexpr uint32_t VERSION = 17;
+static constexpr uint32_t LAST_COMP_VERSION = 16;
+static constexpr uint64_t HEADER_SIZE = 40;
+
+static inline uint32_t read32(const std::vector<uint8_t>& blob, uint64_t off)
+{
+	return (
+		(static_cast<uint32_t>(blob[off]) << 24U) |
+		(static_cast<uint32_t>(blob[off + 1]) << 16U) |
+		(static_cast<uint32_t>(blob[off + 2]) << 8U) |
+		static_cast<uint32_t>(blob[off + 3])
+	);
+}
+
+static inline void write32(std::vector<uint8_t>& blob, uint64_t off, uint32_t value)
+{
+	blob[off] = value >> 24U;
+	blob[off + 1] = value >> 16U;
+	blob[off + 2] = value >> 8U;
+	blob[off + 3] = value;
+}
+
+static inline void push32(std::vector<uint8_t>& blob, uint32_t value)
+{
+	blob.resize(blob.size() + 4);
+	write32(blob, blob.size() - 4, value);
+}
+
+static inline void align4(std::vector<uint8_t>& blob)
+{
+	blob.resize((blob.size() + 3) & ~3ULL);
+}
+
+class Parser {
+private:
+	const std::vector<uint8_t>& blob;
+	uint64_t pos;
+	uint64_t end;
+	uint64_t strings;
+	uint64_t strings_end;
+
+	bool string(uint64_t off, uint64_t limit, std::string& out)
+	{
+		const void *nul = std::memchr(&blob[off], 0, limit - off);
+		if (!nul)
+			return false;
+
+		out.assign(
+			reinterpret_cast<const char*>(&blob[off]),
+			static_cast<const uint8_t*>(nul) - &blob[off]
+		);
+		return true;
+	}
+
+	bool token(uint32_t& tok)
+	{
+		do {
+			if (pos + 4 > end)
+				return false;
+
+			tok = read32(blob, pos);
+			pos += 4;
+		} while (tok == Token::NOP);
+
+		return true;
+	}
+
+public:
+	Parser(const std::vector<uint8_t>& _blob, uint64_t _pos, uint64_t _end,
+		uint64_t _strings, uint64_t _strings_end) :
+		blob(_blob), pos(_pos), end(_end),
+		strings(_strings), strings_end(_strings_end) {};
+
+	bool node(Fdt::Node& node)
+	{
+		uint32_t tok;
+
+		if (!token(tok) || tok != Token::BEGIN_NODE)
+			return false;
+
+		if (pos >= end || !string(pos, end, node.name))
+			return false;
+
+		pos = (pos + node.name.size() + 4) & ~3ULL;
+
+		while (token(tok)) {
+			switch (tok) {
+			case Token::PROP:
+			{
+				if (pos + 8 > end)
+					return false;
+
+				uint64_t len = read32(blob, pos);
+				uint64_t nameoff = read32(blob, pos + 4);
+				pos += 8;
+
+				if (pos + len > end || strings + nameoff >= strings_end)
+					return false;
+
+				Fdt::Property prop;
+				if (!string(strings + nameoff, strings_end, prop.name))
+					return false;
+
+				prop.value.assign(&blob[pos], &blob[pos] + len);
+				node.props.push_back(std::move(prop));
+
+				pos = (pos + len + 3) & ~3ULL;
+				break;
+			}
+			case Token::BEGIN_NODE:
+				pos -= 4;
+				node.children.emplace_back();
+
+				if (!this->node(node.children.back()))
+					return false;
+				break;
+			case Token::END_NODE:
+				return true;
+			default:
+				return false;
+			}
+		}
+
+		return false;
+	}
+
+	bool finish(void)
+	{
+		uint32_t tok;
+
+		return token(tok) && tok == Token::END;
+	}
+};
+
+class Writer {
+private:
+	std::vector<uint8_t>& dt_struct;
+	std::vector<uint8_t>& dt_strings;
+	std::unordered_map<std::string, uint32_t> offsets;
+
+	uint32_t string(const std::string& name)
+	{
+		auto it = offsets.find(name);
+		if (it != offsets.end())
+			return it->second;
+
+		uint32_t off = dt_strings.size();
+		dt_strings.insert(dt_strings.end(), name.begin(), name.end());
+		dt_strings.push_back(0);
+		offsets.emplace(name, off);
+
+		return off;
+	}
+
+public:
+	Writer(std::vector<uint8_t>& _dt_struct, std::vector<uint8_t>& _dt_strings) :
+		dt_struct(_dt_struct), dt_strings(_dt_strings) {};
+
+	void node(const Fdt::Node& node)
+	{
+		push32(dt_struct, Token::BEGIN_NODE);
+		dt_struct.insert(dt_struct.end(), node.name.begin(), node.name.end());
+		dt_struct.push_back(0);
+		align4(dt_struct);
+
+		for (const Fdt::Property& prop : node.props) {
+			push32(dt_struct, Token::PROP);
+			push32(dt_struct, prop.value.size());
+			push32(dt_struct, string(prop.name));
+			dt_struct.insert(dt_struct.end(), prop.value.begin(), prop.value.end());
+			align4(dt_struct);
+		}
+
+		for (const Fdt::Node& child : node.children)
+			this->node(child);
+
+		push32(dt_struct, Token::END_NODE);
+	}
+};
+
+}; // namespace
+
+Fdt::Node *Fdt::Node::child(std::string_view name)
+{
+	for (Node& node : children)
+		if (node.name == name)
+			return &node;
+
+	return nullptr;
+}
+
+std::vector<uint8_t> *Fdt::Node::prop(std::string_view name)
+{
+	for (Property& property : props)
+		if (property.name == name)
+			return &property.value;
+
+	return nullptr;
+}
+
+void Fdt::Node::set(std::string_view name, std::vector<uint32_t> values)
+{
+	std::vector<uint8_t> *value = prop(name);
+
+	if (value)
+		*value = cells(values);
+	else
+		props.push_back({std::string(name), cells(values)});
+}
+
+bool Fdt::cell(const std::vector<uint8_t>& value, uint64_t idx, uint32_t& out)
+{
+	if (value.size() / 4 <= idx)
+		return false;
+
+	out = read32(value, idx * 4);
+	return true;
+}
+
+std::vector<uint8_t> Fdt::cells(const std::vector<uint32_t>& values)
+{
+	std::vector<uint8_t> value;
+
+	for (uint32_t cell : values)
+		push32(value, cell);
+
+	return value;
+}
+
+bool Fdt::load(const std::vector<uint8_t>& blob)
+{
+	if (blob.size() < HEADER_SIZE || read32(blob, 0) != MAGIC)
+		return false;
+
+	uint64_t total = read32(blob, 4);
+	uint64_t off_struct = read32(blob, 8);
+	uint64_t off_strings = read32(blob, 12);
+	uint64_t off_reserved = read32(blob, 16);
+	uint64_t size_strings = read32(blob, 32);
+	uint64_t size_struct = read32(blob, 36);
+
+	if (total > blob.size() ||
+		off_struct + size_struct > total ||
+		off_strings + size_strings > total ||
+		off_reserved + 16 > total)
+	{
+		return false;
+	}
+
+	boot_cpuid = read32(blob, 28);
+
+	reserved.clear();
+	for (uint64_t off = off_reserved; off + 16 <= total; off += 16) {
+		reserved.insert(reserved.end(), &blob[off], &blob[off] + 16);
+
+		if (std::all_of(&blob[off], &blob[off] + 16,
+			[](uint8_t byte) {return byte == 0;}))
+		{
+			break;
+		}
+	}
+
+	Parser parser(
+		blob,
+		off_struct, off_struct + size_struct,
+		off_strings, off_strings + size_strings
+	);
+
+	root = Node();
+
+	return parser.node(root) && parser.finish();
+}
+
+std::vector<uint8_t> Fdt::save(void) const
+{
+	std::vector<uint8_t> dt_struct;
+	std::vector<uint8_t> dt_strings;
+
+	Writer(dt_struct, dt_strings).node(root);
+	push32(dt_struct, Token::END);
+
+	// An empty reservation map still takes its terminating entry
+	std::vector<uint8_t> blob(HEADER_SIZE + std::max<uint64_t>(reserved.size(), 16));
+
+	if (!reserved.empty())
+		std::copy(reserved.begin(), reserved.end(), blob.begin() + HEADER_SIZE);
+
+	uint64_t off_struct = blob.size();
+	blob.insert(blob.end(), dt_struct.begin(), dt_struct.end());
+
+	uint64_t off_strings = blob.size();
+	blob.insert(blob.end(), dt_strings.begin(), dt_strings.end());
+	align4(blob);
+
+	write32(blob, 0, MAGIC);
+	write32(blob, 4, blob.size());
+	write32(blob, 8, off_struct);
+	write32(blob, 12, off_strings);
+	write32(blob, 16, HEADER_SIZE);
+	write32(blob, 20, VERSION);
+	write32(blob, 24, LAST_COMP_VERSION);
+	write32(blob, 28, boot_cpuid);
+	write32(blob, 32, dt_strings.size());
+	write32(blob, 36, dt_struct.size());
+
+	return blob;
+}
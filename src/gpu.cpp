@@ -1,5 +1,7 @@
 #include "errors.hpp"
 #include "gpu.hpp"
+#include "cpu.hpp"
+#include "plic.hpp"
 #include "settings.hpp"
 #include "font.hpp"
 
@@ -282,14 +284,14 @@ void Gpu::dispatch(void)
 {
 	isr |= 0xc0;
 
-	if ((ier & IER_RDI) && (lsr & LSR_DR)) {
-		is_uart_interrupting = true;
-		return;
-	}
-	
-	if ((ier & IER_THRI) && (lsr & LSR_TEMT)) {
-		is_uart_interrupting = true;
-		return;
+	if (((ier & IER_RDI) && (lsr & LSR_DR)) ||
+		((ier & IER_THRI) && (lsr & LSR_TEMT)))
+	{
+		Plic *plic = static_cast<Plic*>(
+			bus->get(DeviceName::PLIC)
+		);
+		if (plic)
+			plic->update_pending(UART_IRQN);
 	}
 }
 
@@ -304,6 +306,8 @@ void Gpu::render(void)
 
 void Gpu::tick(void)
 {
+	cpu->scheduler.schedule(DeviceName::GPU, TICK_PERIOD);
+
 	uint64_t current_tick = get_milliseconds();
 
 	if (current_tick - last_tick <= 10) {
@@ -1,11 +1,17 @@
 #include <cstdint>
+#include <array>
+#include <algorithm>
+#include <unordered_map>
 #include <functional>
 #include <cstring>
 #include <cmath>
 #include <cfenv>
+#include <atomic>
+#include <type_traits>
 #include "settings.hpp"
 #include "instruction.hpp"
 #include "mmu.hpp"
+#include "dram.hpp"
 #include "cpu.hpp"
 #include "registers.hpp"
 
@@ -38,7 +44,7 @@ static void fld(Decoder decoder)
 
     uint64_t addr = cpu->int_regs[rs1] + off;
 
-    cpu->flt_regs[rd].u64 = mmu->load(addr, 64);
+    cpu->flt_regs[rd].u64 = mmu->load<64>(addr);
 }
 
 static void lw(Decoder decoder)
@@ -50,7 +56,7 @@ static void lw(Decoder decoder)
 
     uint64_t addr = cpu->int_regs[rs1] + off;
 
-    cpu->int_regs[rd] = UCAST<int32_t>(mmu->load(addr, 32));
+    cpu->int_regs[rd] = UCAST<int32_t>(mmu->load<32>(addr));
 }
 
 static void ld(Decoder decoder)
@@ -61,7 +67,7 @@ static void ld(Decoder decoder)
 
     uint64_t addr = cpu->int_regs[rs1] + off;
 
-    cpu->int_regs[rd] = mmu->load(addr, 64);
+    cpu->int_regs[rd] = mmu->load<64>(addr);
 }
 
 static void reserved(Decoder decoder)
@@ -81,7 +87,7 @@ static void fsd(Decoder decoder)
     uint64_t addr = cpu->int_regs[rs1] + off;
     uint64_t rs1_bits = cpu->flt_regs[rs1].u64;
 
-    mmu->store(addr, rs1_bits, 64);
+    mmu->store<64>(addr, rs1_bits);
 }
 
 static void sw(Decoder decoder)
@@ -95,7 +101,7 @@ static void sw(Decoder decoder)
     uint64_t addr = cpu->int_regs[rs1] + off;
     uint32_t val = cpu->int_regs[rs2];
 
-    mmu->store(addr, val, 32);
+    mmu->store<32>(addr, val);
 }
 
 static void sd(Decoder decoder)
@@ -108,7 +114,7 @@ static void sd(Decoder decoder)
     uint64_t addr = cpu->int_regs[rs1] + off;
     uint64_t val = cpu->int_regs[rs2];
 
-    mmu->store(addr, val, 64);
+    mmu->store<64>(addr, val);
 }
 
 static void andi(Decoder decoder)
@@ -301,9 +307,8 @@ static void fldsp(Decoder decoder)
 				   ((decoder.insn >> 7U) & 0x20U) |
                    ((decoder.insn >> 2U) & 0x18U);
 
-    uint64_t val = mmu->load(
-		cpu->int_regs[IRegs::sp] + off, 
-		64
+    uint64_t val = mmu->load<64>(
+		cpu->int_regs[IRegs::sp] + off
 	);
 
     cpu->flt_regs[rd].u64 = val;
@@ -316,9 +321,8 @@ static void lwsp(Decoder decoder)
 				   ((decoder.insn >> 7U) & 0x20U) |
                    ((decoder.insn >> 2U) & 0x1cU);
 
-    uint32_t val = mmu->load(
-		cpu->int_regs[IRegs::sp] + off, 
-		32
+    uint32_t val = mmu->load<32>(
+		cpu->int_regs[IRegs::sp] + off
 	);
 
     cpu->int_regs[rd] = UCAST<int32_t>(val);
@@ -331,9 +335,8 @@ static void ldsp(Decoder decoder)
 				   ((decoder.insn >> 7U) & 0x20U) |
                    ((decoder.insn >> 2U) & 0x18U);
 
-    uint64_t val = mmu->load(
-		cpu->int_regs[IRegs::sp] + off, 
-		64
+    uint64_t val = mmu->load<64>(
+		cpu->int_regs[IRegs::sp] + off
 	);
 
     cpu->int_regs[rd] = val;
@@ -372,7 +375,7 @@ static void fsdsp(Decoder decoder)
     uint64_t addr = cpu->int_regs[IRegs::sp] + off;
     uint64_t rs1_bits = cpu->flt_regs[rs1].u64;
 
-    mmu->store(addr, rs1_bits, 64);
+    mmu->store<64>(addr, rs1_bits);
 }
 
 static void swsp(Decoder decoder)
@@ -384,7 +387,7 @@ static void swsp(Decoder decoder)
     uint64_t addr = cpu->int_regs[IRegs::sp] + off;
     uint32_t val = cpu->int_regs[rs1];
 
-    mmu->store(addr, val, 32);
+    mmu->store<32>(addr, val);
 }
 
 static void sdsp(Decoder decoder)
@@ -396,7 +399,7 @@ static void sdsp(Decoder decoder)
     uint64_t addr = cpu->int_regs[IRegs::sp] + off;
     uint64_t val = cpu->int_regs[rs1];
 
-    mmu->store(addr, val, 64);
+    mmu->store<64>(addr, val);
 }
 
 static void quadrant0(Decoder decoder)
@@ -566,7 +569,7 @@ static void funct3(Decoder decoder)
 		ASSIGN_IF_NO_EXC(
 			rd,
 			SCAST<int8_t>(
-				mmu->load(addr, 8)
+				mmu->load<8>(addr)
 			)
 		);
 		break;
@@ -576,7 +579,7 @@ static void funct3(Decoder decoder)
 		ASSIGN_IF_NO_EXC(
 			rd,
 			SCAST<int16_t>(
-				mmu->load(addr, 16)
+				mmu->load<16>(addr)
 			)
 		);
 		break;
@@ -586,7 +589,7 @@ static void funct3(Decoder decoder)
 		ASSIGN_IF_NO_EXC(
 			rd,
 			SCAST<int32_t>(
-				mmu->load(addr, 32)
+				mmu->load<32>(addr)
 			)
 		);
 		break;
@@ -596,7 +599,7 @@ static void funct3(Decoder decoder)
 		ASSIGN_IF_NO_EXC(
 			rd,
 			SCAST<int64_t>(
-				mmu->load(addr, 64)
+				mmu->load<64>(addr)
 			)
 		);
 		break;
@@ -605,7 +608,7 @@ static void funct3(Decoder decoder)
 	{
 		ASSIGN_IF_NO_EXC(
 			rd,
-			mmu->load(addr, 8)
+			mmu->load<8>(addr)
 		);
 		break;
 	}
@@ -613,7 +616,7 @@ static void funct3(Decoder decoder)
 	{
 		ASSIGN_IF_NO_EXC(
 			rd,
-			mmu->load(addr, 16)
+			mmu->load<16>(addr)
 		);
 		break;
 	}
@@ -621,7 +624,7 @@ static void funct3(Decoder decoder)
 	{
 		ASSIGN_IF_NO_EXC(
 			rd,
-			mmu->load(addr, 32)
+			mmu->load<32>(addr)
 		);
 		break;
 	}
@@ -634,6 +637,19 @@ static void funct3(Decoder decoder)
 	}
 }
 
+template<typename T>
+static void load(const Op& op)
+{
+	uint64_t addr = cpu->int_regs[op.rs1] + op.imm;
+
+	ASSIGN_IF_NO_EXC(
+		op.rd,
+		SCAST<T>(
+			mmu->load<sizeof(T) * 8>(addr)
+		)
+	);
+}
+
 }; // namespace LD
 
 namespace ST {
@@ -649,20 +665,28 @@ static void funct3(Decoder decoder)
 
 	switch (decoder.funct3()) {
 	case Decoder::StType::SB:
-		mmu->store(addr, value, 8);
+		mmu->store<8>(addr, value);
 		break;
 	case Decoder::StType::SH:
-		mmu->store(addr, value, 16);
+		mmu->store<16>(addr, value);
 		break;
 	case Decoder::StType::SW:
-		mmu->store(addr, value, 32);
+		mmu->store<32>(addr, value);
 		break;
 	case Decoder::StType::SD:
-		mmu->store(addr, value, 64);
+		mmu->store<64>(addr, value);
 		break;
 	}
 }
 
+template<typename T>
+static void store(const Op& op)
+{
+	uint64_t addr = cpu->int_regs[op.rs1] + op.imm;
+
+	mmu->store<sizeof(T) * 8>(addr, cpu->int_regs[op.rs2]);
+}
+
 }; // namespace ST
 
 namespace R {
@@ -762,8 +786,7 @@ static void funct3(Decoder decoder)
 		case Decoder::RType::DIV:
 			switch (val2) {
 			case -1:
-				if (val1 == std::numeric_limits<int32_t>::min())
-					cpu->int_regs[rd] = val1;
+				cpu->int_regs[rd] = -uval1;
 				break;
 			case 0:
 				cpu->int_regs[rd] = ~0ULL;
@@ -793,11 +816,8 @@ static void funct3(Decoder decoder)
 				cpu->int_regs[rd] = ~0ULL;
 			break;
 		case Decoder::RType::SRA:
-		{
-			int32_t hval1 = uval1;
-			cpu->int_regs[rd] = hval1 >> val2;
+			cpu->int_regs[rd] = val1 >> (uval2 & 0x3f);
 			break;
-		}
 		default:
 			cpu->set_exception(
 				Exception::ILLEGAL_INSTRUCTION,
@@ -814,8 +834,7 @@ static void funct3(Decoder decoder)
 		case Decoder::RType::REM:
 			switch (val2) {
 			case -1:
-				if (val1 == std::numeric_limits<int64_t>::min())
-					cpu->int_regs[rd] = 0;
+				cpu->int_regs[rd] = 0;
 				break;
 			case 0:
 				cpu->int_regs[rd] = val1;
@@ -861,6 +880,131 @@ static void funct3(Decoder decoder)
 	}
 }
 
+static void add(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] + cpu->int_regs[op.rs2];
+}
+
+static void sub(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] - cpu->int_regs[op.rs2];
+}
+
+static void sll(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] << 
+		(cpu->int_regs[op.rs2] & 0x3f);
+}
+
+static void slt(const Op& op)
+{
+	cpu->int_regs[op.rd] = static_cast<int64_t>(cpu->int_regs[op.rs1]) <
+		static_cast<int64_t>(cpu->int_regs[op.rs2]);
+}
+
+static void sltu(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] < cpu->int_regs[op.rs2];
+}
+
+static void xor_(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] ^ cpu->int_regs[op.rs2];
+}
+
+static void srl(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] >> 
+		(cpu->int_regs[op.rs2] & 0x3f);
+}
+
+static void sra(const Op& op)
+{
+	cpu->int_regs[op.rd] = static_cast<int64_t>(cpu->int_regs[op.rs1]) >>
+		(cpu->int_regs[op.rs2] & 0x3f);
+}
+
+static void or_(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] | cpu->int_regs[op.rs2];
+}
+
+static void and_(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] & cpu->int_regs[op.rs2];
+}
+
+static void mul(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] * cpu->int_regs[op.rs2];
+}
+
+static void mulh(const Op& op)
+{
+	__int128 val1 = static_cast<int64_t>(cpu->int_regs[op.rs1]);
+	__int128 val2 = static_cast<int64_t>(cpu->int_regs[op.rs2]);
+
+	cpu->int_regs[op.rd] = (val1 * val2) >> 64;
+}
+
+static void mulhsu(const Op& op)
+{
+	__int128 val1 = static_cast<int64_t>(cpu->int_regs[op.rs1]);
+	unsigned __int128 val2 = cpu->int_regs[op.rs2];
+
+	cpu->int_regs[op.rd] = (static_cast<unsigned __int128>(val1) * val2) >> 64;
+}
+
+static void mulhu(const Op& op)
+{
+	unsigned __int128 val1 = cpu->int_regs[op.rs1];
+	unsigned __int128 val2 = cpu->int_regs[op.rs2];
+
+	cpu->int_regs[op.rd] = (val1 * val2) >> 64;
+}
+
+static void div(const Op& op)
+{
+	int64_t val1 = cpu->int_regs[op.rs1];
+	int64_t val2 = cpu->int_regs[op.rs2];
+
+	if (!val2)
+		cpu->int_regs[op.rd] = ~0ULL;
+	else if (val2 == -1)
+		cpu->int_regs[op.rd] = -static_cast<uint64_t>(val1);
+	else
+		cpu->int_regs[op.rd] = val1 / val2;
+}
+
+static void divu(const Op& op)
+{
+	uint64_t val1 = cpu->int_regs[op.rs1];
+	uint64_t val2 = cpu->int_regs[op.rs2];
+
+	cpu->int_regs[op.rd] = val2 ? val1 / val2 : ~0ULL;
+}
+
+static void rem(const Op& op)
+{
+	int64_t val1 = cpu->int_regs[op.rs1];
+	int64_t val2 = cpu->int_regs[op.rs2];
+
+	if (!val2)
+		cpu->int_regs[op.rd] = val1;
+	else if (val2 == -1)
+		cpu->int_regs[op.rd] = 0;
+	else
+		cpu->int_regs[op.rd] = val1 % val2;
+}
+
+static void remu(const Op& op)
+{
+	uint64_t val1 = cpu->int_regs[op.rs1];
+	uint64_t val2 = cpu->int_regs[op.rs2];
+
+	cpu->int_regs[op.rd] = val2 ? val1 % val2 : val1;
+}
+
 }; // namespace R
 
 namespace R64 {
@@ -909,8 +1053,9 @@ static void funct3(Decoder decoder)
 
 		switch (val2) {
 		case -1:
-			if (val1 == std::numeric_limits<int32_t>::min())
-				cpu->int_regs[rd] = static_cast<int64_t>(val1);
+			cpu->int_regs[rd] = UCAST<int32_t>(
+				-static_cast<uint32_t>(val1)
+			);
 			break;
 		case 0:
 			cpu->int_regs[rd] = ~0ULL;
@@ -980,7 +1125,9 @@ static void funct3(Decoder decoder)
 		int64_t val1 = static_cast<int32_t>(
 			cpu->int_regs[rs1]
 		);
-		int64_t val2 = cpu->int_regs[rs2];
+		int64_t val2 = static_cast<int32_t>(
+			cpu->int_regs[rs2]
+		);
 		
 		if (val2)
 			cpu->int_regs[rd] = UCAST<int32_t>(
@@ -994,13 +1141,13 @@ static void funct3(Decoder decoder)
 	}
 	case Decoder::R64Type::REMUW:
 	{
-		uint64_t val1 = cpu->int_regs[rs1];
-		int64_t val2 = cpu->int_regs[rs2];
+		uint32_t val1 = cpu->int_regs[rs1];
+		uint32_t val2 = cpu->int_regs[rs2];
 		
 		if (val2)
-			cpu->int_regs[rd] = val1 % val2;
+			cpu->int_regs[rd] = UCAST<int32_t>(val1 % val2);
 		else
-			cpu->int_regs[rd] = val1;
+			cpu->int_regs[rd] = UCAST<int32_t>(val1);
 		break;
 	}
 	default:
@@ -1012,6 +1159,92 @@ static void funct3(Decoder decoder)
 	}
 }
 
+static void addw(const Op& op)
+{
+	cpu->int_regs[op.rd] = UCAST<int32_t>(
+		cpu->int_regs[op.rs1] + cpu->int_regs[op.rs2]
+	);
+}
+
+static void subw(const Op& op)
+{
+	cpu->int_regs[op.rd] = UCAST<int32_t>(
+		cpu->int_regs[op.rs1] - cpu->int_regs[op.rs2]
+	);
+}
+
+static void sllw(const Op& op)
+{
+	cpu->int_regs[op.rd] = UCAST<int32_t>(
+		cpu->int_regs[op.rs1] << (cpu->int_regs[op.rs2] & 0x1f)
+	);
+}
+
+static void srlw(const Op& op)
+{
+	cpu->int_regs[op.rd] = UCAST<int32_t>(
+		static_cast<uint32_t>(cpu->int_regs[op.rs1]) >> 
+			(cpu->int_regs[op.rs2] & 0x1f)
+	);
+}
+
+static void sraw(const Op& op)
+{
+	cpu->int_regs[op.rd] = UCAST<int32_t>(
+		static_cast<int32_t>(cpu->int_regs[op.rs1]) >> 
+			(cpu->int_regs[op.rs2] & 0x1f)
+	);
+}
+
+static void mulw(const Op& op)
+{
+	cpu->int_regs[op.rd] = UCAST<int32_t>(
+		cpu->int_regs[op.rs1] * cpu->int_regs[op.rs2]
+	);
+}
+
+static void divw(const Op& op)
+{
+	int32_t val1 = cpu->int_regs[op.rs1];
+	int32_t val2 = cpu->int_regs[op.rs2];
+
+	if (!val2)
+		cpu->int_regs[op.rd] = ~0ULL;
+	else if (val2 == -1)
+		cpu->int_regs[op.rd] = UCAST<int32_t>(-static_cast<uint32_t>(val1));
+	else
+		cpu->int_regs[op.rd] = UCAST<int32_t>(val1 / val2);
+}
+
+static void divuw(const Op& op)
+{
+	uint32_t val1 = cpu->int_regs[op.rs1];
+	uint32_t val2 = cpu->int_regs[op.rs2];
+
+	cpu->int_regs[op.rd] = val2 ? UCAST<int32_t>(val1 / val2) : ~0ULL;
+}
+
+static void remw(const Op& op)
+{
+	int32_t val1 = cpu->int_regs[op.rs1];
+	int32_t val2 = cpu->int_regs[op.rs2];
+
+	if (!val2)
+		cpu->int_regs[op.rd] = UCAST<int32_t>(val1);
+	else if (val2 == -1)
+		cpu->int_regs[op.rd] = 0;
+	else
+		cpu->int_regs[op.rd] = UCAST<int32_t>(val1 % val2);
+}
+
+static void remuw(const Op& op)
+{
+	uint32_t val1 = cpu->int_regs[op.rs1];
+	uint32_t val2 = cpu->int_regs[op.rs2];
+
+	cpu->int_regs[op.rd] = UCAST<int32_t>(val2 ? val1 % val2 : val1);
+}
+
 }; // namespace R64
 
 namespace I {
@@ -1073,6 +1306,53 @@ static void funct3(Decoder decoder)
 	}
 }
 
+static void addi(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] + op.imm;
+}
+
+static void slli(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] << (op.imm & 0x3f);
+}
+
+static void slti(const Op& op)
+{
+	cpu->int_regs[op.rd] = static_cast<int64_t>(cpu->int_regs[op.rs1]) <
+		static_cast<int64_t>(op.imm);
+}
+
+static void sltiu(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] < op.imm;
+}
+
+static void xori(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] ^ op.imm;
+}
+
+static void srli(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] >> (op.imm & 0x3f);
+}
+
+static void srai(const Op& op)
+{
+	cpu->int_regs[op.rd] = static_cast<int64_t>(cpu->int_regs[op.rs1]) >> 
+		(op.imm & 0x3f);
+}
+
+static void ori(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] | op.imm;
+}
+
+static void andi(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[op.rs1] & op.imm;
+}
+
 }; // namespace I
 
 namespace I64 {
@@ -1131,6 +1411,32 @@ static void funct3(Decoder decoder)
 	}
 }
 
+static void addiw(const Op& op)
+{
+	cpu->int_regs[op.rd] = UCAST<int32_t>(cpu->int_regs[op.rs1] + op.imm);
+}
+
+static void slliw(const Op& op)
+{
+	cpu->int_regs[op.rd] = UCAST<int32_t>(
+		cpu->int_regs[op.rs1] << (op.imm & 0x3f)
+	);
+}
+
+static void srliw(const Op& op)
+{
+	cpu->int_regs[op.rd] = UCAST<int32_t>(
+		static_cast<uint32_t>(cpu->int_regs[op.rs1]) >> (op.imm & 0x1f)
+	);
+}
+
+static void sraiw(const Op& op)
+{
+	cpu->int_regs[op.rd] = UCAST<int64_t>(
+		static_cast<int32_t>(cpu->int_regs[op.rs1]) >> (op.imm & 0x1f)
+	);
+}
+
 }; // namespace I64
 
 namespace FD {
@@ -1311,14 +1617,14 @@ static void fl(Decoder decoder)
 	switch (decoder.funct3()) {
 	case Decoder::FdType::FLW:
 	{
-		uint32_t tmp = mmu->load(addr, 32);
+		uint32_t tmp = mmu->load<32>(addr);
 		uint64_t val = tmp | 0xffffffff00000000ULL;
 		cpu->flt_regs[rd].u64 = val;
 		break;
 	}
 	case Decoder::FdType::FLD:
 	{
-		uint64_t val = mmu->load(addr, 64);
+		uint64_t val = mmu->load<64>(addr);
 		cpu->flt_regs[rd].u64 = val;
 		break;
 	}
@@ -1346,10 +1652,10 @@ static void fs(Decoder decoder)
 
 	switch (decoder.funct3()) {
 	case Decoder::FdType::FSW:
-		mmu->store(addr, cpu->flt_regs[rs2].u32, 32);
+		mmu->store<32>(addr, cpu->flt_regs[rs2].u32);
 		break;
 	case Decoder::FdType::FSD:
-		mmu->store(addr, cpu->flt_regs[rs2].u64, 64);
+		mmu->store<64>(addr, cpu->flt_regs[rs2].u64);
 		break;
 	default:
 		cpu->set_exception(
@@ -2339,238 +2645,159 @@ static void funct3(Decoder decoder)
 	}
 }
 
+template<typename T, typename C>
+static void branch(const Op& op)
+{
+	T val1 = cpu->int_regs[op.rs1];
+	T val2 = cpu->int_regs[op.rs2];
+
+	if (C()(val1, val2))
+		cpu->pc += op.imm - op.size;
+}
+
 }; // namespace B
 
 namespace A {
 
-static void funct3(Decoder decoder)
+template<typename T>
+static void amo(Decoder decoder)
 {
+	using S = std::make_signed_t<T>;
+
 	uint64_t rd = decoder.rd();
-	uint64_t rs1 = decoder.rs1();
-	uint64_t rs2 = decoder.rs2();
-	uint64_t addr = cpu->int_regs[rs1];
+	uint64_t addr = cpu->int_regs[decoder.rs1()];
+	uint64_t funct5 = decoder.funct5();
+	T src = cpu->int_regs[decoder.rs2()];
 
-	switch (decoder.funct3()) {
-	case Decoder::AType::AMOW:
+	if (addr % sizeof(T)) {
+		cpu->set_exception(
+			funct5 == Decoder::AType::LR ?
+				Exception::LOAD_ADDRESS_MISALIGNED :
+				Exception::STORE_ADDRESS_MISALIGNED,
+			addr
+		);
+		return;
+	}
+
+	uint64_t p_addr = mmu->translate(
+		addr,
+		funct5 == Decoder::AType::LR ?
+			Mmu::AccessType::LOAD :
+			Mmu::AccessType::STORE
+	);
+
+	if (cpu->exception.current != Exception::NONE)
+		return;
+
+	Dram *dram = static_cast<Dram*>(
+		bus->get(DeviceName::DRAM)
+	);
+
+	if (!dram || !dram->contains(p_addr, sizeof(T))) {
+		cpu->set_exception(
+			funct5 == Decoder::AType::LR ?
+				Exception::LOAD_ACCESS_FAULT :
+				Exception::STORE_ACCESS_FAULT,
+			addr
+		);
+		return;
+	}
+
+	std::atomic_ref<T> mem(
+		*reinterpret_cast<T*>(dram->host(p_addr))
+	);
+	T old = 0;
+
+	auto update = [&mem](auto op) {
+		T expected = mem.load();
+
+		while (!mem.compare_exchange_weak(expected, op(expected)));
+
+		return expected;
+	};
+
+	switch (funct5) {
+	case Decoder::AType::LR:
+		old = mem.load();
+		bus->reservations.reserve(cpu->hartid, p_addr, old);
+		cpu->int_regs[rd] = UCAST<S>(old);
+		return;
+	case Decoder::AType::SC:
 	{
-		if (cpu->int_regs[rs1] % 4)
-			cpu->set_exception(
-				Exception::INSTRUCTION_ADDRESS_MISALIGNED,
-				decoder.insn
-			);
+		uint64_t reserved = 0;
+		T expected = 0;
 
-		int32_t val1 = mmu->load(addr, 32);
-		int32_t val2 = cpu->int_regs[rs2];
+		if (bus->reservations.take(cpu->hartid, p_addr, reserved)) {
+			expected = reserved;
 
-		switch (decoder.funct5()) {
-		case Decoder::AType::ADD:
-			mmu->store(addr, static_cast<int32_t>(val1 + val2), 32);
-			cpu->int_regs[rd] = UCAST<int32_t>(val1);
-			break;
-		case Decoder::AType::SWAP:
-			mmu->store(addr, val2, 32);
-			cpu->int_regs[rd] = UCAST<int32_t>(val1);
-			break;
-		case Decoder::AType::LR:
-			cpu->int_regs[rd] = UCAST<int32_t>(val1);
-			cpu->reservations.insert(addr);
-			break;
-		case Decoder::AType::SC:
-			if (cpu->reservations.contains(addr)) {
-				cpu->reservations.erase(addr);
-				mmu->store(
-					addr, 
-					static_cast<uint32_t>(cpu->int_regs[rs2]), 
-					32
-				);
+			if (mem.compare_exchange_strong(expected, src)) {
+				bus->reservations.invalidate(p_addr);
+				cpu->block_cache.invalidate(p_addr);
 				cpu->int_regs[rd] = 0;
-			} else {
-				cpu->int_regs[rd] = 1;
+				return;
 			}
-			break;
-		case Decoder::AType::XOR:
-			mmu->store(
-				addr, 
-				UCAST<int32_t>(val1 ^ val2), 
-				32
-			);
-			cpu->int_regs[rd] = UCAST<int32_t>(val1);
-			break;
-		case Decoder::AType::OR:
-			mmu->store(
-				addr,
-				UCAST<int32_t>(val1 | val2),
-				32
-			);
-			cpu->int_regs[rd] = UCAST<int32_t>(val1);
-			break;
-		case Decoder::AType::AND:
-			mmu->store(
-				addr,
-				UCAST<int32_t>(val1 & val2),
-				32
-			);
-			cpu->int_regs[rd] = UCAST<int32_t>(val1);
-			break;
-		case Decoder::AType::MIN:
-			mmu->store(
-				addr,
-				UCAST<int32_t>(std::min(val1, val2)),
-				32
-			);
-			cpu->int_regs[rd] = UCAST<int32_t>(val1);
-			break;
-		case Decoder::AType::MAX:
-			mmu->store(
-				addr,
-				UCAST<int32_t>(std::max(val1, val2)),
-				32
-			);
-			cpu->int_regs[rd] = UCAST<int32_t>(val1);
-			break;
-		case Decoder::AType::MINU:
-			mmu->store(
-				addr,
-				std::min(
-					static_cast<uint32_t>(mmu->load(addr, 32)),
-					static_cast<uint32_t>(cpu->int_regs[rs2])
-				),
-				32
-			);
-			cpu->int_regs[rd] = UCAST<int32_t>(val1);
-			break;
-		case Decoder::AType::MAXU:
-			mmu->store(
-				addr,
-				std::max(
-					static_cast<uint32_t>(mmu->load(addr, 32)),
-					static_cast<uint32_t>(cpu->int_regs[rs2])
-				),
-				32
-			);
-			cpu->int_regs[rd] = UCAST<int32_t>(val1);
-			break;
-		default:
-			cpu->set_exception(
-				Exception::ILLEGAL_INSTRUCTION,
-				decoder.insn
-			);
-			break;
 		}
+
+		cpu->int_regs[rd] = 1;
+		return;
+	}
+	case Decoder::AType::SWAP:
+		old = mem.exchange(src);
+		break;
+	case Decoder::AType::ADD:
+		old = mem.fetch_add(src);
+		break;
+	case Decoder::AType::XOR:
+		old = mem.fetch_xor(src);
 		break;
+	case Decoder::AType::OR:
+		old = mem.fetch_or(src);
+		break;
+	case Decoder::AType::AND:
+		old = mem.fetch_and(src);
+		break;
+	case Decoder::AType::MIN:
+		old = update([src](T val) {
+			return std::min<S>(val, src);
+		});
+		break;
+	case Decoder::AType::MAX:
+		old = update([src](T val) {
+			return std::max<S>(val, src);
+		});
+		break;
+	case Decoder::AType::MINU:
+		old = update([src](T val) {
+			return std::min<T>(val, src);
+		});
+		break;
+	case Decoder::AType::MAXU:
+		old = update([src](T val) {
+			return std::max<T>(val, src);
+		});
+		break;
+	default:
+		cpu->set_exception(
+			Exception::ILLEGAL_INSTRUCTION,
+			decoder.insn
+		);
+		return;
 	}
-	case Decoder::AType::AMOD:
-	{
-		if (cpu->int_regs[rs1] % 8)
-			cpu->set_exception(
-				Exception::ILLEGAL_INSTRUCTION,
-				decoder.insn
-			);
-		
-		int64_t val1 = mmu->load(addr, 64);
-		int64_t val2 = cpu->int_regs[rs2];
 
-		switch (decoder.funct5()) {
-		case Decoder::AType::ADD:
-			mmu->store(
-				addr, 
-				static_cast<int64_t>(val1 + val2),
-				64
-			);
-			cpu->int_regs[rd] = UCAST<int64_t>(val1);
-			break;
-		case Decoder::AType::SWAP:
-			mmu->store(addr, val2, 64);
-			cpu->int_regs[rd] = UCAST<int64_t>(val1);
-			break;
-		case Decoder::AType::LR:
-			cpu->int_regs[rd] = UCAST<int64_t>(val1);
-			cpu->reservations.insert(addr);
-			break;
-		case Decoder::AType::SC:
-			if (cpu->reservations.contains(addr)) {
-				cpu->reservations.erase(addr);
-				mmu->store(
-					addr,
-					static_cast<uint64_t>(cpu->int_regs[rs2]),
-					64
-				);
-				cpu->int_regs[rd] = 0;
-			} else {
-				cpu->int_regs[rd] = 1;
-			}
-			break;
-		case Decoder::AType::XOR:
-			mmu->store(
-				addr,
-				UCAST<int64_t>(val1 ^ val2),
-				64
-			);
-			cpu->int_regs[rd] = UCAST<int64_t>(val1);
-			break;
-		case Decoder::AType::OR:
-			mmu->store(
-				addr,
-				UCAST<int64_t>(val1 | val2),
-				64
-			);
-			cpu->int_regs[rd] = UCAST<int64_t>(val1);
-			break;
-		case Decoder::AType::AND:
-			mmu->store(
-				addr,
-				UCAST<int64_t>(val1 & val2),
-				64
-			);
-			cpu->int_regs[rd] = UCAST<int64_t>(val1);
-			break;
-		case Decoder::AType::MIN:
-			mmu->store(
-				addr,
-				UCAST<int64_t>(std::min(val1, val2)),
-				64
-			);
-			cpu->int_regs[rd] = UCAST<int64_t>(val1);
-			break;
-		case Decoder::AType::MAX:
-			mmu->store(
-				addr,
-				UCAST<int64_t>(std::max(val1, val2)),
-				64
-			);
-			cpu->int_regs[rd] = UCAST<int64_t>(val1);
-			break;
-		case Decoder::AType::MINU:
-			mmu->store(
-				addr,
-				UCAST<uint64_t>(std::min(
-					static_cast<uint64_t>(mmu->load(addr, 64)),
-					static_cast<uint64_t>(cpu->int_regs[rs2])
-				)),
-				64
-			);
-			cpu->int_regs[rd] = UCAST<uint64_t>(val1);
-			break;
-		case Decoder::AType::MAXU:
-			mmu->store(
-				addr,
-				UCAST<uint64_t>(std::max(
-					static_cast<uint64_t>(mmu->load(addr, 64)),
-					static_cast<uint64_t>(cpu->int_regs[rs2])
-				)),
-				64
-			);
-			cpu->int_regs[rd] = UCAST<uint64_t>(val1);
-			break;
-		default:
-			cpu->set_exception(
-				Exception::ILLEGAL_INSTRUCTION,
-				decoder.insn
-			);
-			break;
-		}
+	bus->reservations.invalidate(p_addr);
+	cpu->block_cache.invalidate(p_addr);
+	cpu->int_regs[rd] = UCAST<S>(old);
+}
+
+static void funct3(Decoder decoder)
+{
+	switch (decoder.funct3()) {
+	case Decoder::AType::AMOW:
+		amo<uint32_t>(decoder);
+		break;
+	case Decoder::AType::AMOD:
+		amo<uint64_t>(decoder);
 		break;
-	}
 	default:
 		cpu->set_exception(
 			Exception::ILLEGAL_INSTRUCTION, 
@@ -2754,6 +2981,22 @@ static void satp_h(Decoder decoder,
 	mmu->update();
 }
 
+static void mstatus_h(Decoder decoder,
+	uint64_t csr, uint64_t rhs, op_t op)
+{
+	priviledged_h(decoder, csr, rhs, op);
+
+	mmu->update();
+}
+
+static void sstatus_h(Decoder decoder,
+	uint64_t csr, uint64_t rhs, op_t op)
+{
+	default_h(decoder, csr, rhs, op);
+
+	mmu->update();
+}
+
 static std::array<handler_t, 4096> csr_handlers = [](void) {
 	std::array<handler_t, 4096> tmp;
 	std::fill(tmp.begin(), tmp.end(), default_h);
@@ -2771,7 +3014,8 @@ static std::array<handler_t, 4096> csr_handlers = [](void) {
 	tmp[CRegs::Address::TDATA1] = readonly_h;
 
 	tmp[CRegs::Address::CYCLE] = enforced_h;
-	tmp[CRegs::Address::MSTATUS] = priviledged_h;
+	tmp[CRegs::Address::MSTATUS] = mstatus_h;
+	tmp[CRegs::Address::SSTATUS] = sstatus_h;
 
 	return tmp;
 }();
@@ -2848,6 +3092,8 @@ static void sret(Decoder decoder)
 			Cpu::Mode::USER
 		)
 	);
+
+	mmu->update();
 }
 
 static void mret(Decoder decoder)
@@ -2930,6 +3176,8 @@ static void mret(Decoder decoder)
 			Cpu::Mode::USER
 		)
 	);
+
+	mmu->update();
 }
 
 static void environment(Decoder decoder)
@@ -2939,6 +3187,7 @@ static void environment(Decoder decoder)
 
 	switch (funct7) {
 	case Decoder::CSRType::SFENCEVMA7:
+	case Decoder::CSRType::SINVALVMA7:
 	{
 		uint64_t tvm = read_bit(
 			cpu->csr_regs.load(
@@ -2947,15 +3196,36 @@ static void environment(Decoder decoder)
 			CRegs::Mstatus::TVM
 		);
 		
-		if (tvm == 1 || cpu->mode == Cpu::Mode::USER)
+		if (tvm == 1 || cpu->mode == Cpu::Mode::USER) {
 			cpu->set_exception(
 				Exception::ILLEGAL_INSTRUCTION,
 				decoder.insn
 			);
+			return;
+		}
 		
-		mmu->update();
+		// Blocks are cached by physical address and
+		// never cross a page, so they stay valid
+		mmu->flush_tlb(
+			decoder.rs1() != 0, cpu->int_regs[decoder.rs1()],
+			decoder.rs2() != 0, cpu->int_regs[decoder.rs2()]
+		);
 		return;
 	}
+	case Decoder::CSRType::SFENCEINVAL7:
+		// Invalidations take effect at once, which leaves
+		// nothing for the ordering fences of Svinval to do
+		if (cpu->mode == Cpu::Mode::USER ||
+			decoder.rs1() != 0 || decoder.rd() != 0 ||
+			(imm != Decoder::CSRType::SFENCEWINVAL && 
+			 imm != Decoder::CSRType::SFENCEINVALIR))
+		{
+			cpu->set_exception(
+				Exception::ILLEGAL_INSTRUCTION,
+				decoder.insn
+			);
+		}
+		return;
 	case Decoder::CSRType::HFENCEBVMA7:
 		cpu->set_exception(
 			Exception::ILLEGAL_INSTRUCTION,
@@ -3024,6 +3294,7 @@ static void environment(Decoder decoder)
 	case Decoder::CSRType::WFI:
 		switch (funct7) {
 		case Decoder::CSRType::WFI7:
+			cpu->sleep = true;
 			break;
 		default:
 			cpu->set_exception(
@@ -3133,7 +3404,8 @@ namespace O {
 
 static void fence(Decoder decoder)
 {
-	
+	if (decoder.funct3() == Decoder::FenceType::FENCE_I)
+		cpu->block_cache.flush();
 }
 
 static void jal(Decoder decoder)
@@ -3177,8 +3449,635 @@ static void lui(Decoder decoder)
 	);
 }
 
+static void lui(const Op& op)
+{
+	cpu->int_regs[op.rd] = op.imm;
+}
+
+static void auipc(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->pc + op.imm;
+}
+
+static void jal(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->pc + op.size;
+	cpu->pc += op.imm - op.size;
+}
+
+static void jalr(const Op& op)
+{
+	uint64_t tmp = cpu->pc + op.size;
+
+	cpu->pc = ((cpu->int_regs[op.rs1] + op.imm) & ~1ULL) - op.size;
+	cpu->int_regs[op.rd] = tmp;
+}
+
+static void illegal(const Op& op)
+{
+	cpu->set_exception(
+		Exception::ILLEGAL_INSTRUCTION,
+		op.insn
+	);
+}
+
+static void fallback(const Op& op)
+{
+	execute(Decoder(op.insn));
+}
+
+static void nop(const Op& op)
+{
+}
+
+template<void (*F)(Decoder)>
+static void decoded(const Op& op)
+{
+	F(Decoder(op.insn));
+}
+
 }; // namespace O
 
+namespace Dispatch {
+
+struct Handler {
+	exec_t exec;
+	exec_t run;
+};
+
+using expand_t = void (*)(Op&, Decoder);
+
+template<exec_t F>
+static void thread(const Op& op)
+{
+	cpu->csr_regs.store(
+		CRegs::Address::CYCLE,
+		cpu->csr_regs.load(
+			CRegs::Address::CYCLE
+		) + op.count
+	);
+
+	cpu->int_regs[IRegs::zero] = 0;
+
+	F(op);
+
+	if (cpu->exception.current != Exception::NONE)
+		return;
+
+	cpu->pc += op.size;
+
+	if (cpu->block_cache.is_stale())
+		return;
+
+	const Op& next = (&op)[1];
+
+	return next.run(next);
+}
+
+static void end(const Op& op)
+{
+}
+
+template<exec_t F>
+static constexpr Handler handler = { F, thread<F> };
+
+static inline void set(Op& op, Handler handler)
+{
+	op.exec = handler.exec;
+	op.run = handler.run;
+}
+
+static inline void set(Op& op, Handler handler, 
+	uint64_t rd, uint64_t rs1, uint64_t rs2, uint64_t imm)
+{
+	set(op, handler);
+
+	op.rd = rd;
+	op.rs1 = rs1;
+	op.rs2 = rs2;
+	op.imm = imm;
+}
+
+static inline uint64_t key(uint64_t opcode, uint64_t funct3, uint64_t funct7)
+{
+	return (opcode >> 2U) | (funct3 << 5U) | (funct7 << 8U);
+}
+
+static inline uint64_t immediate(Decoder decoder)
+{
+	switch (decoder.opcode()) {
+	case Decoder::OpcodeType::LD:
+	case Decoder::OpcodeType::I:
+	case Decoder::OpcodeType::I64:
+	case Decoder::OpcodeType::JALR:
+		return decoder.imm_i();
+	case Decoder::OpcodeType::ST:
+		return decoder.imm_s();
+	case Decoder::OpcodeType::B:
+		return decoder.imm_b();
+	case Decoder::OpcodeType::JAL:
+		return decoder.imm_j();
+	case Decoder::OpcodeType::LUI:
+	case Decoder::OpcodeType::AUIPC:
+		return UCAST<int32_t>(decoder.insn & 0xfffff000ULL);
+	default:
+		return 0;
+	}
+}
+
+static std::array<Handler, 1 << 15> handlers = [](void) {
+	std::array<Handler, 1 << 15> tmp;
+	std::fill(tmp.begin(), tmp.end(), handler<O::fallback>);
+
+	auto exact = [&tmp](uint64_t opcode, uint64_t funct3, 
+		uint64_t funct7, Handler h) {
+		tmp[key(opcode, funct3, funct7)] = h;
+	};
+
+	auto funct3 = [&tmp](uint64_t opcode, uint64_t funct3, Handler h) {
+		for (uint64_t funct7 = 0; funct7 < 0x80; funct7++)
+			tmp[key(opcode, funct3, funct7)] = h;
+	};
+
+	auto opcode = [&funct3](uint64_t opcode, Handler h) {
+		for (uint64_t i = 0; i < 8; i++)
+			funct3(opcode, i, h);
+	};
+
+	using OT = Decoder::OpcodeType;
+
+	funct3(OT::LD, Decoder::LdType::LB, handler<LD::load<int8_t>>);
+	funct3(OT::LD, Decoder::LdType::LH, handler<LD::load<int16_t>>);
+	funct3(OT::LD, Decoder::LdType::LW, handler<LD::load<int32_t>>);
+	funct3(OT::LD, Decoder::LdType::LD, handler<LD::load<int64_t>>);
+	funct3(OT::LD, Decoder::LdType::LBU, handler<LD::load<uint8_t>>);
+	funct3(OT::LD, Decoder::LdType::LHU, handler<LD::load<uint16_t>>);
+	funct3(OT::LD, Decoder::LdType::LWU, handler<LD::load<uint32_t>>);
+
+	funct3(OT::ST, Decoder::StType::SB, handler<ST::store<uint8_t>>);
+	funct3(OT::ST, Decoder::StType::SH, handler<ST::store<uint16_t>>);
+	funct3(OT::ST, Decoder::StType::SW, handler<ST::store<uint32_t>>);
+	funct3(OT::ST, Decoder::StType::SD, handler<ST::store<uint64_t>>);
+
+	funct3(OT::I, Decoder::IType::ADDI, handler<I::addi>);
+	funct3(OT::I, Decoder::IType::SLLI, handler<I::slli>);
+	funct3(OT::I, Decoder::IType::SLTI, handler<I::slti>);
+	funct3(OT::I, Decoder::IType::SLTIU, handler<I::sltiu>);
+	funct3(OT::I, Decoder::IType::XORI, handler<I::xori>);
+	funct3(OT::I, Decoder::IType::ORI, handler<I::ori>);
+	funct3(OT::I, Decoder::IType::ANDI, handler<I::andi>);
+
+	for (uint64_t shamt5 = 0; shamt5 < 2; shamt5++) {
+		exact(OT::I, Decoder::IType::SRI, 
+			(Decoder::IType::SRLI << 1) | shamt5, handler<I::srli>);
+		exact(OT::I, Decoder::IType::SRI, 
+			(Decoder::IType::SRAI << 1) | shamt5, handler<I::srai>);
+	}
+
+	funct3(OT::I64, Decoder::I64Type::ADDIW, handler<I64::addiw>);
+	funct3(OT::I64, Decoder::I64Type::SLLIW, handler<I64::slliw>);
+	exact(OT::I64, Decoder::I64Type::SRIW, 
+		Decoder::I64Type::SRLIW, handler<I64::srliw>);
+	exact(OT::I64, Decoder::I64Type::SRIW, 
+		Decoder::I64Type::SRAIW, handler<I64::sraiw>);
+
+	using RT = Decoder::RType;
+
+	exact(OT::R, RT::ADDMULSUB, RT::ADD, handler<R::add>);
+	exact(OT::R, RT::ADDMULSUB, RT::MUL, handler<R::mul>);
+	exact(OT::R, RT::ADDMULSUB, RT::SUB, handler<R::sub>);
+	exact(OT::R, RT::SLLMULH, RT::SLL, handler<R::sll>);
+	exact(OT::R, RT::SLLMULH, RT::MULH, handler<R::mulh>);
+	exact(OT::R, RT::SLTMULHSU, RT::SLT, handler<R::slt>);
+	exact(OT::R, RT::SLTMULHSU, RT::MULHSU, handler<R::mulhsu>);
+	exact(OT::R, RT::SLTUMULHU, RT::SLTU, handler<R::sltu>);
+	exact(OT::R, RT::SLTUMULHU, RT::MULHU, handler<R::mulhu>);
+	exact(OT::R, RT::XORDIV, RT::XOR, handler<R::xor_>);
+	exact(OT::R, RT::XORDIV, RT::DIV, handler<R::div>);
+	exact(OT::R, RT::SR, RT::SRL, handler<R::srl>);
+	exact(OT::R, RT::SR, RT::DIVU, handler<R::divu>);
+	exact(OT::R, RT::SR, RT::SRA, handler<R::sra>);
+	exact(OT::R, RT::ORREM, RT::OR, handler<R::or_>);
+	exact(OT::R, RT::ORREM, RT::REM, handler<R::rem>);
+	exact(OT::R, RT::ANDREM, RT::AND, handler<R::and_>);
+	exact(OT::R, RT::ANDREM, RT::REMU, handler<R::remu>);
+
+	using R64T = Decoder::R64Type;
+
+	exact(OT::R64, R64T::ADDSUBW, R64T::ADDW, handler<R64::addw>);
+	exact(OT::R64, R64T::ADDSUBW, R64T::MULW, handler<R64::mulw>);
+	exact(OT::R64, R64T::ADDSUBW, R64T::SUBW, handler<R64::subw>);
+	exact(OT::R64, R64T::SLLW, 0x00, handler<R64::sllw>);
+	exact(OT::R64, R64T::DIVW, 0x01, handler<R64::divw>);
+	exact(OT::R64, R64T::SRW, R64T::SRLW, handler<R64::srlw>);
+	exact(OT::R64, R64T::SRW, R64T::DIVUW, handler<R64::divuw>);
+	exact(OT::R64, R64T::SRW, R64T::SRAW, handler<R64::sraw>);
+	exact(OT::R64, R64T::REMW, 0x01, handler<R64::remw>);
+	exact(OT::R64, R64T::REMUW, 0x01, handler<R64::remuw>);
+
+	using BT = Decoder::BType;
+
+	funct3(OT::B, BT::BEQ, 
+		handler<B::branch<uint64_t, std::equal_to<uint64_t>>>);
+	funct3(OT::B, BT::BNE, 
+		handler<B::branch<uint64_t, std::not_equal_to<uint64_t>>>);
+	funct3(OT::B, BT::BLT, 
+		handler<B::branch<int64_t, std::less<int64_t>>>);
+	funct3(OT::B, BT::BGE, 
+		handler<B::branch<int64_t, std::greater_equal<int64_t>>>);
+	funct3(OT::B, BT::BLTU, 
+		handler<B::branch<uint64_t, std::less<uint64_t>>>);
+	funct3(OT::B, BT::BGEU, 
+		handler<B::branch<uint64_t, std::greater_equal<uint64_t>>>);
+
+	opcode(OT::LUI, handler<O::lui>);
+	opcode(OT::AUIPC, handler<O::auipc>);
+	opcode(OT::JAL, handler<O::jal>);
+	opcode(OT::JALR, handler<O::jalr>);
+
+	opcode(OT::FENCE, handler<O::decoded<O::fence>>);
+	opcode(OT::FL, handler<O::decoded<FD::fl>>);
+	opcode(OT::FS, handler<O::decoded<FD::fs>>);
+	opcode(OT::FMADD, handler<O::decoded<FD::fmadd>>);
+	opcode(OT::FMSUB, handler<O::decoded<FD::fmsub>>);
+	opcode(OT::FNMADD, handler<O::decoded<FD::fnmadd>>);
+	opcode(OT::FNMSUB, handler<O::decoded<FD::fnmsub>>);
+	opcode(OT::FOTHER, handler<O::decoded<FD::fother>>);
+	opcode(OT::ATOMIC, handler<O::decoded<A::funct3>>);
+	opcode(OT::CSR, handler<O::decoded<CSR::funct3>>);
+
+	return tmp;
+}();
+
+namespace Expand {
+
+static inline uint64_t imm_ci(Decoder decoder)
+{
+	uint64_t imm = ((decoder.insn >> 7U) & 0x20U) | 
+				   ((decoder.insn >> 2U) & 0x1fU);
+
+	if (imm & 0x20U)
+		imm = UCAST<int8_t>(imm | 0xc0U);
+	
+	return imm;
+}
+
+static inline uint64_t imm_cb(Decoder decoder)
+{
+	uint64_t imm = ((decoder.insn >> 4U) & 0x100U) | ((decoder.insn << 1U) & 0xc0U) |
+				   ((decoder.insn << 3U) & 0x20U) | ((decoder.insn >> 7U) & 0x18U) |
+				   ((decoder.insn >> 2U) & 0x6U);
+
+	if (imm & 0x100U)
+		imm = UCAST<int16_t>(imm | 0xfe00U);
+
+	return imm;
+}
+
+static inline uint64_t imm_cj(Decoder decoder)
+{
+	uint64_t imm = ((decoder.insn >> 1U) & 0x800U) | ((decoder.insn << 2U) & 0x400U) |
+				   ((decoder.insn >> 1U) & 0x300U) | ((decoder.insn << 1U) & 0x80U) |
+				   ((decoder.insn >> 1U) & 0x40U) | ((decoder.insn << 3U) & 0x20U) |
+				   ((decoder.insn >> 7U) & 0x10U) | ((decoder.insn >> 2U) & 0xeU);
+
+	if (imm & 0x800U)
+		imm = UCAST<int16_t>(imm | 0xf000U);
+
+	return imm;
+}
+
+static inline uint64_t off_cw(Decoder decoder)
+{
+	return ((decoder.insn << 1U) & 0x40U) | 
+		   ((decoder.insn >> 7U) & 0x38U) |
+		   ((decoder.insn >> 4U) & 0x04U);
+}
+
+static inline uint64_t off_cd(Decoder decoder)
+{
+	return ((decoder.insn << 1U) & 0xc0U) | 
+		   ((decoder.insn >> 7U) & 0x38U);
+}
+
+static void illegal(Op& op, Decoder decoder)
+{
+	set(op, handler<O::illegal>);
+}
+
+template<void (*F)(Decoder)>
+static void decoded(Op& op, Decoder decoder)
+{
+	set(op, handler<O::decoded<F>>);
+}
+
+static void addi4spn(Op& op, Decoder decoder)
+{
+	uint64_t imm = ((decoder.insn >> 1U) & 0x3c0U) | ((decoder.insn >> 7U) & 0x30U) |
+				   ((decoder.insn >> 2U) & 0x08U) | ((decoder.insn >> 4U) & 0x04U);
+
+	set(op, handler<I::addi>, decoder.rd_c(), IRegs::sp, 0, imm);
+}
+
+static void lw(Op& op, Decoder decoder)
+{
+	set(op, handler<LD::load<int32_t>>, 
+		decoder.rd_c(), decoder.rs1_c(), 0, off_cw(decoder));
+}
+
+static void ld(Op& op, Decoder decoder)
+{
+	set(op, handler<LD::load<int64_t>>, 
+		decoder.rd_c(), decoder.rs1_c(), 0, off_cd(decoder));
+}
+
+static void sw(Op& op, Decoder decoder)
+{
+	set(op, handler<ST::store<uint32_t>>, 
+		0, decoder.rs1_c(), decoder.rs2_c(), off_cw(decoder));
+}
+
+static void sd(Op& op, Decoder decoder)
+{
+	set(op, handler<ST::store<uint64_t>>, 
+		0, decoder.rs1_c(), decoder.rs2_c(), off_cd(decoder));
+}
+
+static void addi(Op& op, Decoder decoder)
+{
+	set(op, handler<I::addi>, 
+		decoder.rd(), decoder.rd(), 0, imm_ci(decoder));
+}
+
+static void addiw(Op& op, Decoder decoder)
+{
+	set(op, handler<I64::addiw>, 
+		decoder.rd(), decoder.rd(), 0, imm_ci(decoder));
+}
+
+static void li(Op& op, Decoder decoder)
+{
+	set(op, handler<I::addi>, 
+		decoder.rd(), IRegs::zero, 0, imm_ci(decoder));
+}
+
+static void op03(Op& op, Decoder decoder)
+{
+	switch (decoder.rd()) {
+	case Decoder::Q1::NOP:
+		set(op, handler<O::nop>);
+		break;
+	case Decoder::Q1::ADDI16SP:
+	{
+		uint64_t imm = ((decoder.insn >> 3U) & 0x200U) | 
+					   ((decoder.insn >> 2U) & 0x10U) |
+					   ((decoder.insn << 1U) & 0x40U) | 
+					   ((decoder.insn << 4U) & 0x180U) |
+					   ((decoder.insn << 3U) & 0x20U);
+
+		if (imm & 0x200U)
+			imm = UCAST<int16_t>(imm | 0xfc00U);
+
+		set(op, handler<I::addi>, IRegs::sp, IRegs::sp, 0, imm);
+		break;
+	}
+	default:
+		set(op, handler<O::lui>, decoder.rd(), 0, 0, imm_ci(decoder) << 12U);
+		break;
+	}
+}
+
+static void op04(Op& op, Decoder decoder)
+{
+	uint64_t rd = decoder.rs1_c();
+	uint64_t rs2 = decoder.rs2_c();
+
+	switch (decoder.funct2_c()) {
+	case Decoder::Q1::SRLI:
+		set(op, handler<I::srli>, rd, rd, 0, decoder.shamt_c());
+		return;
+	case Decoder::Q1::SRAI:
+		set(op, handler<I::srai>, rd, rd, 0, decoder.shamt_c());
+		return;
+	case Decoder::Q1::ANDI:
+		set(op, handler<I::andi>, rd, rd, 0, imm_ci(decoder));
+		return;
+	}
+
+	static constexpr Handler arith[8] = {
+		handler<R::sub>, handler<R::xor_>, 
+		handler<R::or_>, handler<R::and_>,
+		handler<R64::subw>, handler<R64::addw>,
+		handler<O::illegal>, handler<O::illegal>
+	};
+
+	uint64_t index = ((decoder.insn >> 10U) & 0x04U) | 
+					 ((decoder.insn >> 5U) & 0x03U);
+
+	set(op, arith[index], rd, rd, rs2, 0);
+}
+
+static void j(Op& op, Decoder decoder)
+{
+	set(op, handler<O::jal>, IRegs::zero, 0, 0, imm_cj(decoder));
+}
+
+static void beqz(Op& op, Decoder decoder)
+{
+	set(op, handler<B::branch<uint64_t, std::equal_to<uint64_t>>>,
+		0, decoder.rs1_c(), IRegs::zero, imm_cb(decoder));
+}
+
+static void bnez(Op& op, Decoder decoder)
+{
+	set(op, handler<B::branch<uint64_t, std::not_equal_to<uint64_t>>>,
+		0, decoder.rs1_c(), IRegs::zero, imm_cb(decoder));
+}
+
+static void slli(Op& op, Decoder decoder)
+{
+	set(op, handler<I::slli>, 
+		decoder.rd(), decoder.rd(), 0, decoder.shamt_c());
+}
+
+static void lwsp(Op& op, Decoder decoder)
+{
+	uint64_t off = ((decoder.insn << 4U) & 0xc0U) | 
+				   ((decoder.insn >> 7U) & 0x20U) |
+				   ((decoder.insn >> 2U) & 0x1cU);
+
+	set(op, handler<LD::load<int32_t>>, decoder.rd(), IRegs::sp, 0, off);
+}
+
+static void ldsp(Op& op, Decoder decoder)
+{
+	uint64_t off = ((decoder.insn << 4U) & 0x1c0U) | 
+				   ((decoder.insn >> 7U) & 0x20U) |
+				   ((decoder.insn >> 2U) & 0x18U);
+
+	set(op, handler<LD::load<int64_t>>, decoder.rd(), IRegs::sp, 0, off);
+}
+
+static void op04_q2(Op& op, Decoder decoder)
+{
+	uint64_t rd = decoder.rd();
+	uint64_t rs2 = (decoder.insn >> 2U) & 0x1fU;
+
+	if (!((decoder.insn >> 12U) & 0x01U)) {
+		if (rs2)
+			set(op, handler<R::add>, rd, IRegs::zero, rs2, 0);
+		else
+			set(op, handler<O::jalr>, IRegs::zero, rd, 0, 0);
+	} else {
+		if (rs2)
+			set(op, handler<R::add>, rd, rd, rs2, 0);
+		else if (rd)
+			set(op, handler<O::jalr>, IRegs::ra, rd, 0, 0);
+		else
+			set(op, handler<O::decoded<C::op4>>);
+	}
+}
+
+static void swsp(Op& op, Decoder decoder)
+{
+	uint64_t off = ((decoder.insn >> 1U) & 0xc0U) | 
+				   ((decoder.insn >> 7U) & 0x3cU);
+
+	set(op, handler<ST::store<uint32_t>>, 
+		0, IRegs::sp, (decoder.insn >> 2U) & 0x1fU, off);
+}
+
+static void sdsp(Op& op, Decoder decoder)
+{
+	uint64_t off = ((decoder.insn >> 1U) & 0x1c0U) | 
+				   ((decoder.insn >> 7U) & 0x38U);
+
+	set(op, handler<ST::store<uint64_t>>, 
+		0, IRegs::sp, (decoder.insn >> 2U) & 0x1fU, off);
+}
+
+}; // namespace Expand
+
+static std::array<expand_t, 32> expanders = [](void) {
+	std::array<expand_t, 32> tmp;
+	std::fill(tmp.begin(), tmp.end(), Expand::illegal);
+
+	auto q0 = [&tmp](uint64_t funct3, expand_t e) {
+		tmp[Decoder::OpcodeType::COMPRESSED_QUANDRANT0 | (funct3 << 2)] = e;
+	};
+
+	auto q1 = [&tmp](uint64_t funct3, expand_t e) {
+		tmp[Decoder::OpcodeType::COMPRESSED_QUANDRANT1 | (funct3 << 2)] = e;
+	};
+
+	auto q2 = [&tmp](uint64_t funct3, expand_t e) {
+		tmp[Decoder::OpcodeType::COMPRESSED_QUANDRANT2 | (funct3 << 2)] = e;
+	};
+
+	q0(Decoder::Q0::ADDI4SPN, Expand::addi4spn);
+	q0(Decoder::Q0::FLD, Expand::decoded<C::fld>);
+	q0(Decoder::Q0::LW, Expand::lw);
+	q0(Decoder::Q0::LD, Expand::ld);
+	q0(Decoder::Q0::RESERVED, Expand::decoded<C::reserved>);
+	q0(Decoder::Q0::FSD, Expand::decoded<C::fsd>);
+	q0(Decoder::Q0::SW, Expand::sw);
+	q0(Decoder::Q0::SD, Expand::sd);
+
+	q1(Decoder::Q1::ADDI, Expand::addi);
+	q1(Decoder::Q1::ADDIW, Expand::addiw);
+	q1(Decoder::Q1::LI, Expand::li);
+	q1(Decoder::Q1::OP03, Expand::op03);
+	q1(Decoder::Q1::OP04, Expand::op04);
+	q1(Decoder::Q1::J, Expand::j);
+	q1(Decoder::Q1::BEQZ, Expand::beqz);
+	q1(Decoder::Q1::BNEZ, Expand::bnez);
+
+	q2(Decoder::Q2::SLLI, Expand::slli);
+	q2(Decoder::Q2::FLDSP, Expand::decoded<C::fldsp>);
+	q2(Decoder::Q2::LWSP, Expand::lwsp);
+	q2(Decoder::Q2::LDSP, Expand::ldsp);
+	q2(Decoder::Q2::OP04, Expand::op04_q2);
+	q2(Decoder::Q2::FSDSP, Expand::decoded<C::fsdsp>);
+	q2(Decoder::Q2::SWSP, Expand::swsp);
+	q2(Decoder::Q2::SDSP, Expand::sdsp);
+
+	return tmp;
+}();
+
+}; // namespace Dispatch
+
+namespace Fuse {
+
+using Dispatch::Handler;
+using Dispatch::handler;
+
+static void lui_addi(const Op& op)
+{
+	cpu->int_regs[op.rd] = op.imm;
+	cpu->stats.fused[Fusion::LUI_ADDI]++;
+}
+
+static void auipc_addi(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->pc + op.imm;
+	cpu->stats.fused[Fusion::AUIPC_ADDI]++;
+}
+
+static void auipc_jalr(const Op& op)
+{
+	uint64_t tmp = cpu->pc + op.size;
+
+	cpu->int_regs[op.rs1] = cpu->pc + UCAST<int32_t>(op.insn & 0xfffff000U);
+	cpu->pc = ((cpu->pc + op.imm) & ~1ULL) - op.size;
+	cpu->int_regs[op.rd] = tmp;
+	cpu->stats.fused[Fusion::AUIPC_JALR]++;
+}
+
+static void slli_srli(const Op& op)
+{
+	cpu->int_regs[op.rd] = (cpu->int_regs[op.rs2] << (op.imm & 0x3f)) >> 
+		((op.imm >> 8U) & 0x3f);
+	cpu->stats.fused[Fusion::SLLI_SRLI]++;
+}
+
+template<typename T, typename C>
+static void li_branch(const Op& op)
+{
+	cpu->int_regs[op.rd] = Dispatch::Expand::imm_ci(Decoder(op.insn));
+	cpu->stats.fused[Fusion::LI_BRANCH]++;
+
+	B::branch<T, C>(op);
+}
+
+template<typename T, typename C>
+static void mv_branch(const Op& op)
+{
+	cpu->int_regs[op.rd] = cpu->int_regs[(op.insn >> 2U) & 0x1fU];
+	cpu->stats.fused[Fusion::MV_BRANCH]++;
+
+	B::branch<T, C>(op);
+}
+
+static constexpr Handler li_branches[6] = {
+	handler<li_branch<uint64_t, std::equal_to<uint64_t>>>,
+	handler<li_branch<uint64_t, std::not_equal_to<uint64_t>>>,
+	handler<li_branch<int64_t, std::less<int64_t>>>,
+	handler<li_branch<int64_t, std::greater_equal<int64_t>>>,
+	handler<li_branch<uint64_t, std::less<uint64_t>>>,
+	handler<li_branch<uint64_t, std::greater_equal<uint64_t>>>
+};
+
+static constexpr Handler mv_branches[6] = {
+	handler<mv_branch<uint64_t, std::equal_to<uint64_t>>>,
+	handler<mv_branch<uint64_t, std::not_equal_to<uint64_t>>>,
+	handler<mv_branch<int64_t, std::less<int64_t>>>,
+	handler<mv_branch<int64_t, std::greater_equal<int64_t>>>,
+	handler<mv_branch<uint64_t, std::less<uint64_t>>>,
+	handler<mv_branch<uint64_t, std::greater_equal<uint64_t>>>
+};
+
+}; // namespace Fuse
+
 uint64_t execute(Decoder decoder)
 {
 	if (decoder.insn == 0) {
@@ -3281,6 +4180,180 @@ uint64_t execute(Decoder decoder)
 	return decoder.size();
 }
 
+Op decode(Decoder decoder)
+{
+	Op op = {
+		.exec = O::fallback,
+		.run = Dispatch::thread<O::fallback>,
+		.imm = 0,
+		.insn = decoder.insn,
+		.rd = static_cast<uint8_t>(decoder.rd()),
+		.rs1 = static_cast<uint8_t>(decoder.rs1()),
+		.rs2 = static_cast<uint8_t>(decoder.rs2()),
+		.size = static_cast<uint8_t>(decoder.size()),
+		.count = 1
+	};
+
+	if (!decoder.insn) {
+		Dispatch::set(op, Dispatch::handler<O::illegal>);
+		return op;
+	}
+
+	if (decoder.size() == 2) {
+		Dispatch::expanders[
+			decoder.opcode_c() | (decoder.funct3_c() << 2)
+		](op, decoder);
+		return op;
+	}
+
+	Dispatch::set(
+		op,
+		Dispatch::handlers[
+			Dispatch::key(
+				decoder.opcode(), 
+				decoder.funct3(), 
+				decoder.funct7()
+			)
+		]
+	);
+	op.imm = Dispatch::immediate(decoder);
+
+	return op;
+}
+
+Op terminator(void)
+{
+	Op op = {};
+
+	Dispatch::set(op, { Dispatch::end, Dispatch::end });
+	return op;
+}
+
+uint64_t kind(const Op& op)
+{
+	static const std::unordered_map<exec_t, uint64_t> kinds = {
+		{ Dispatch::end, Kind::END },
+		{ O::nop, Kind::NOP },
+
+		{ R::add, Kind::ADD },
+		{ R::sub, Kind::SUB },
+		{ R::sll, Kind::SLL },
+		{ R::slt, Kind::SLT },
+		{ R::sltu, Kind::SLTU },
+		{ R::xor_, Kind::XOR },
+		{ R::srl, Kind::SRL },
+		{ R::sra, Kind::SRA },
+		{ R::or_, Kind::OR },
+		{ R::and_, Kind::AND },
+		{ R::mul, Kind::MUL },
+
+		{ R64::addw, Kind::ADDW },
+		{ R64::subw, Kind::SUBW },
+		{ R64::sllw, Kind::SLLW },
+		{ R64::srlw, Kind::SRLW },
+		{ R64::sraw, Kind::SRAW },
+		{ R64::mulw, Kind::MULW },
+
+		{ I::addi, Kind::ADDI },
+		{ I::slti, Kind::SLTI },
+		{ I::sltiu, Kind::SLTIU },
+		{ I::xori, Kind::XORI },
+		{ I::ori, Kind::ORI },
+		{ I::andi, Kind::ANDI },
+		{ I::slli, Kind::SLLI },
+		{ I::srli, Kind::SRLI },
+		{ I::srai, Kind::SRAI },
+
+		{ I64::addiw, Kind::ADDIW },
+		{ I64::slliw, Kind::SLLIW },
+		{ I64::srliw, Kind::SRLIW },
+		{ I64::sraiw, Kind::SRAIW },
+
+		{ LD::load<int8_t>, Kind::LB },
+		{ LD::load<int16_t>, Kind::LH },
+		{ LD::load<int32_t>, Kind::LW },
+		{ LD::load<int64_t>, Kind::LD },
+		{ LD::load<uint8_t>, Kind::LBU },
+		{ LD::load<uint16_t>, Kind::LHU },
+		{ LD::load<uint32_t>, Kind::LWU },
+		{ ST::store<uint8_t>, Kind::SB },
+		{ ST::store<uint16_t>, Kind::SH },
+		{ ST::store<uint32_t>, Kind::SW },
+		{ ST::store<uint64_t>, Kind::SD },
+
+		{ O::lui, Kind::LUI },
+		{ O::auipc, Kind::AUIPC },
+		{ O::jal, Kind::JAL },
+		{ O::jalr, Kind::JALR },
+
+		{ B::branch<uint64_t, std::equal_to<uint64_t>>, Kind::BEQ },
+		{ B::branch<uint64_t, std::not_equal_to<uint64_t>>, Kind::BNE },
+		{ B::branch<int64_t, std::less<int64_t>>, Kind::BLT },
+		{ B::branch<int64_t, std::greater_equal<int64_t>>, Kind::BGE },
+		{ B::branch<uint64_t, std::less<uint64_t>>, Kind::BLTU },
+		{ B::branch<uint64_t, std::greater_equal<uint64_t>>, Kind::BGEU }
+	};
+
+	auto it = kinds.find(op.exec);
+	if (it == kinds.end())
+		return Kind::NONE;
+
+	return it->second;
+}
+
+bool fuse(Op& first, const Op& second)
+{
+	uint64_t k1 = kind(first);
+	uint64_t k2 = kind(second);
+
+	if (!first.rd)
+		return false;
+
+	Op op = first;
+	op.size = first.size + second.size;
+	op.count = first.count + second.count;
+
+	bool chained = second.rs1 == first.rd && second.rd == first.rd;
+
+	if (k1 == Kind::LUI && chained && 
+		(k2 == Kind::ADDI || k2 == Kind::ADDIW)) {
+		op.imm = first.imm + second.imm;
+
+		if (k2 == Kind::ADDIW)
+			op.imm = UCAST<int32_t>(op.imm);
+		
+		Dispatch::set(op, Dispatch::handler<Fuse::lui_addi>);
+	} else if (k1 == Kind::AUIPC && chained && k2 == Kind::ADDI) {
+		op.imm = first.imm + second.imm;
+		Dispatch::set(op, Dispatch::handler<Fuse::auipc_addi>);
+	} else if (k1 == Kind::AUIPC && k2 == Kind::JALR && 
+		second.rs1 == first.rd) {
+		op.rd = second.rd;
+		op.rs1 = first.rd;
+		op.imm = first.imm + second.imm;
+		Dispatch::set(op, Dispatch::handler<Fuse::auipc_jalr>);
+	} else if (k1 == Kind::SLLI && chained && k2 == Kind::SRLI) {
+		op.rs2 = first.rs1;
+		op.imm = (first.imm & 0x3f) | ((second.imm & 0x3f) << 8U);
+		Dispatch::set(op, Dispatch::handler<Fuse::slli_srli>);
+	} else if (first.size == 2 && first.rs1 == IRegs::zero &&
+		(k1 == Kind::ADDI || k1 == Kind::ADD) && 
+		k2 >= Kind::BEQ && k2 <= Kind::BGEU) {
+		op.rs1 = second.rs1;
+		op.rs2 = second.rs2;
+		op.imm = second.imm + first.size;
+
+		if (k1 == Kind::ADDI)
+			Dispatch::set(op, Fuse::li_branches[k2 - Kind::BEQ]);
+		else
+			Dispatch::set(op, Fuse::mv_branches[k2 - Kind::BEQ]);
+	} else
+		return false;
+
+	first = op;
+	return true;
+}
+
 }; // namespace Instruction
 
 };
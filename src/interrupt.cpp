@@ -1,9 +1,9 @@
 #include "registers.hpp"
 #include "common.hpp"
-#include "gpu.hpp"
-#include "virtio.hpp"
 #include "plic.hpp"
+#include "clint.hpp"
 #include "cpu.hpp"
+#include "mmu.hpp"
 #include "interrupt.hpp"
 
 using namespace Emulator;
@@ -26,6 +26,45 @@ std::string_view Interrupt::get_name(void)
 
 void Interrupt::get_pending(void)
 {
+#ifndef EMU_DEBUG
+	Clint *clint = static_cast<Clint*>(
+		bus->get(DeviceName::CLINT)
+	);
+	if (clint) {
+		uint64_t mip = cpu->csr_regs.load(CRegs::Address::MIP);
+
+		mip = write_bit(mip, CRegs::Mask::MSIP_BIT, clint->is_software(cpu->hartid));
+		mip = write_bit(mip, CRegs::Mask::MTIP_BIT, clint->is_timer(cpu->hartid));
+
+		cpu->csr_regs.store(CRegs::Address::MIP, mip);
+	}
+
+	Plic *plic = static_cast<Plic*>(
+		bus->get(DeviceName::PLIC)
+	);
+	if (plic) {
+		if (plic->is_raised(Plic::context(cpu->hartid, Plic::Context::MACHINE)))
+			cpu->csr_regs.store(
+				CRegs::Address::MIP, 
+				write_bit(
+					cpu->csr_regs.load(CRegs::Address::MIP),
+					CRegs::Mask::MEIP_BIT, 
+					1
+				)
+			);
+
+		if (plic->is_raised(Plic::context(cpu->hartid, Plic::Context::SUPERVISOR)))
+			cpu->csr_regs.store(
+				CRegs::Address::MIP, 
+				write_bit(
+					cpu->csr_regs.load(CRegs::Address::MIP),
+					CRegs::Mask::SEIP_BIT, 
+					1
+				)
+			);
+	}
+#endif
+
     switch (cpu->mode) {
     case Cpu::Mode::MACHINE:
     {
@@ -34,7 +73,7 @@ void Interrupt::get_pending(void)
             CRegs::Mstatus::MIE
         );
 
-        if (!mie && !cpu->sleep) {
+        if (!mie) {
             current = Interrupt::NONE;
 			return;
 		}
@@ -48,7 +87,7 @@ void Interrupt::get_pending(void)
             CRegs::Sstatus::SIE
         );
 
-        if (!sie && !cpu->sleep) {
+        if (!sie) {
             current = Interrupt::NONE;
         	return;
 		}
@@ -58,39 +97,6 @@ void Interrupt::get_pending(void)
     default: break;
     }
 
-#ifndef EMU_DEBUG
-    const uint32_t *irqn = 0;
-	
-	Gpu *gpu = static_cast<Gpu*>(
-		bus->get(DeviceName::GPU)
-	);
-	if (gpu)
-    	irqn = gpu->interrupting();
-	
-	Virtio *virtio = static_cast<Virtio*>(
-		bus->get(DeviceName::VIRTIO)
-	);
-	if (virtio)
-    	irqn = virtio->interrupting();
-
-    if (irqn) {
-		Plic *plic = static_cast<Plic*>(
-			bus->get(DeviceName::PLIC)
-		);
-		if (plic)
-        	plic->update_pending(*irqn);
-        
-		cpu->csr_regs.store(
-            CRegs::Address::MIP, 
-            write_bit(
-                cpu->csr_regs.load(CRegs::Address::MIP),
-                CRegs::Mask::SEIP_BIT, 
-                1
-            )
-        );
-    }
-#endif
-
     uint64_t mie = cpu->csr_regs.load(CRegs::Address::MIE);
     uint64_t mip = cpu->csr_regs.load(CRegs::Address::MIP);
     uint64_t pending = mie & mip;
@@ -279,4 +285,6 @@ void Interrupt::process(void)
             )
         );
     }
+
+    mmu->update();
 }
@@ -0,0 +1,791 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include "jit.hpp"
+#include "bus.hpp"
+#include "cpu.hpp"
+#include "dram.hpp"
+#include "mmu.hpp"
+
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(EMU_NO_JIT)
+#define EMU_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace Emulator;
+
+// Slow path of a load or store, the block counts it itself
+static bool access(const Instruction::Op *op)
+{
+	cpu->int_regs[IRegs::zero] = 0;
+
+	op->exec(*op);
+
+	if (cpu->exception.current != Exception::NONE)
+		return true;
+
+	cpu->pc += op->size;
+
+	return cpu->block_cache.is_stale();
+}
+
+static bool step(const Instruction::Op *op)
+{
+	cpu->csr_regs.store(
+		CRegs::Address::CYCLE,
+		cpu->csr_regs.load(
+			CRegs::Address::CYCLE
+		) + op->count
+	);
+
+	return access(op);
+}
+
+static inline bool fits(int64_t value)
+{
+	return value >= std::numeric_limits<int32_t>::min() &&
+		value <= std::numeric_limits<int32_t>::max();
+}
+
+Jit::~Jit(void)
+{
+#ifdef EMU_JIT
+	if (code)
+		munmap(code, CODE_SIZE);
+#endif
+}
+
+void Jit::emit(std::initializer_list<uint8_t> bytes)
+{
+	for (uint8_t byte : bytes)
+		buf.push_back(byte);
+}
+
+void Jit::emit32(uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		buf.push_back(value >> (i * 8));
+}
+
+void Jit::emit64(uint64_t value)
+{
+	for (int i = 0; i < 8; i++)
+		buf.push_back(value >> (i * 8));
+}
+
+uint64_t Jit::jump(uint8_t cond)
+{
+	// jmp rel32 or jcc rel32, bound later
+	if (cond == Cond::ALWAYS)
+		emit({ 0xe9 });
+	else
+		emit({ 0x0f, static_cast<uint8_t>(0x80 | cond) });
+
+	uint64_t at = buf.size();
+	emit32(0);
+
+	return at;
+}
+
+void Jit::jump_to(uint8_t cond, uint64_t target)
+{
+	uint64_t at = jump(cond);
+	uint32_t rel = target - (at + 4);
+
+	std::memcpy(buf.data() + at, &rel, sizeof(rel));
+}
+
+void Jit::bind(uint64_t at)
+{
+	uint32_t rel = buf.size() - (at + 4);
+
+	std::memcpy(buf.data() + at, &rel, sizeof(rel));
+}
+
+void Jit::mov(uint8_t reg, uint64_t value)
+{
+	// mov reg, imm64
+	emit({
+		static_cast<uint8_t>(0x48 | (reg >> 3)),
+		static_cast<uint8_t>(0xb8 | (reg & 7))
+	});
+	emit64(value);
+}
+
+void Jit::load(uint8_t reg, uint64_t index)
+{
+	// mov reg, [rbx + index * 8]
+	emit({ 0x48, 0x8b, static_cast<uint8_t>(0x83 | (reg << 3)) });
+	emit32(index * 8);
+}
+
+void Jit::store(uint8_t reg, uint64_t index)
+{
+	// mov [rbx + index * 8], reg
+	emit({ 0x48, 0x89, static_cast<uint8_t>(0x83 | (reg << 3)) });
+	emit32(index * 8);
+}
+
+void Jit::alu(uint8_t opcode, uint64_t index, bool wide)
+{
+	// op rax, [rbx + index * 8]
+	if (wide)
+		emit({ 0x48 });
+
+	emit({ opcode, 0x83 });
+	emit32(index * 8);
+}
+
+void Jit::alu_imm(uint8_t opcode, uint64_t imm, bool wide)
+{
+	// op rax, imm32
+	if (wide)
+		emit({ 0x48 });
+
+	emit({ opcode });
+	emit32(imm);
+}
+
+void Jit::shift(uint8_t ext, bool wide)
+{
+	// op rax, cl
+	if (wide)
+		emit({ 0x48 });
+
+	emit({ 0xd3, static_cast<uint8_t>(0xc0 | (ext << 3)) });
+}
+
+void Jit::shift_imm(uint8_t ext, uint8_t amount, bool wide)
+{
+	// op rax, imm8
+	if (wide)
+		emit({ 0x48 });
+
+	emit({ 0xc1, static_cast<uint8_t>(0xc0 | (ext << 3)), amount });
+}
+
+void Jit::set(uint8_t cond)
+{
+	// setcc al; movzx eax, al
+	emit({ 0x0f, static_cast<uint8_t>(0x90 | cond), 0xc0 });
+	emit({ 0x0f, 0xb6, 0xc0 });
+}
+
+void Jit::add_rax(int64_t value)
+{
+	if (!value)
+		return;
+
+	if (fits(value)) {
+		// add rax, imm32
+		emit({ 0x48, 0x05 });
+		emit32(value);
+	} else {
+		// mov rcx, imm64; add rax, rcx
+		emit({ 0x48, 0xb9 });
+		emit64(value);
+		emit({ 0x48, 0x01, 0xc8 });
+	}
+}
+
+void Jit::add_pc(int64_t value)
+{
+	if (!value)
+		return;
+
+	if (fits(value)) {
+		// add qword [rbp], imm32
+		emit({ 0x48, 0x81, 0x45, 0x00 });
+		emit32(value);
+	} else {
+		// mov rax, imm64; add [rbp], rax
+		emit({ 0x48, 0xb8 });
+		emit64(value);
+		emit({ 0x48, 0x01, 0x45, 0x00 });
+	}
+}
+
+void Jit::leave(uint64_t retired)
+{
+	// lea rax, [r12 + retired]; jmp epilogue
+	emit({ 0x49, 0x8d, 0x84, 0x24 });
+	emit32(retired);
+	exits.push_back(jump(Cond::ALWAYS));
+}
+
+void Jit::leave_to(uint64_t delta, int64_t value, uint64_t retired)
+{
+	uint64_t target = start + offset + value;
+
+	add_pc(delta + value);
+
+	if (!linkable || slots_used == slots.size() ||
+		(target & Mmu::PAGE_MASK) != (start & Mmu::PAGE_MASK))
+	{
+		leave(retired);
+		return;
+	}
+
+	uint64_t *slot = &slots[slots_used++];
+	*slot = 0;
+	links.push_back({ target, slot });
+
+	// cmp r12, CHAIN_LIMIT; jae leave
+	emit({ 0x49, 0x81, 0xfc });
+	emit32(CHAIN_LIMIT);
+	uint64_t over = jump(Cond::AE);
+	// mov rax, slot; mov rax, [rax]; test rax, rax; jz leave
+	mov(Reg::RAX, reinterpret_cast<uint64_t>(slot));
+	emit({ 0x48, 0x8b, 0x00, 0x48, 0x85, 0xc0 });
+	uint64_t unlinked = jump(Cond::E);
+	// add r12, retired; jmp rax
+	emit({ 0x49, 0x81, 0xc4 });
+	emit32(retired);
+	emit({ 0xff, 0xe0 });
+
+	bind(over);
+	bind(unlinked);
+	leave(retired);
+}
+
+void Jit::call(const Instruction::Op& op, handler_t handler)
+{
+	// mov rdi, &op; mov rax, handler; call rax
+	mov(Reg::RDI, reinterpret_cast<uint64_t>(&op));
+	mov(Reg::RAX, reinterpret_cast<uint64_t>(handler));
+	emit({ 0xff, 0xd0 });
+
+	// mov qword [rbx], 0
+	emit({ 0x48, 0xc7, 0x03 });
+	emit32(0);
+}
+
+void Jit::probe(uint64_t access_type, const uint8_t *code_pages)
+{
+	using Entry = Mmu::TLBEntry;
+
+	static_assert(Mmu::TLB_SETS == 256, "the set is the low byte of the page");
+
+	Dram *dram = static_cast<Dram*>(bus->get(DeviceName::DRAM));
+	uint64_t host = reinterpret_cast<uint64_t>(dram->host(dram->base));
+
+	// cmp qword [rsi], imm8
+	mov(Reg::RSI, reinterpret_cast<uint64_t>(&mmu->mode));
+	emit({ 0x48, 0x83, 0x3e, static_cast<uint8_t>(Mmu::ModeValue::BARE) });
+	uint64_t bare = jump(Cond::E);
+
+	mov(Reg::RSI, reinterpret_cast<uint64_t>(&mmu->data_mode));
+	emit({ 0x48, 0x83, 0x3e, static_cast<uint8_t>(Cpu::Mode::MACHINE) });
+	uint64_t machine = jump(Cond::E);
+
+	// mov rcx, rax; shr rcx, 12; movzx ecx, cl; imul ecx, ecx, set size
+	emit({ 0x48, 0x89, 0xc1, 0x48, 0xc1, 0xe9, 0x0c, 0x0f, 0xb6, 0xc9 });
+	emit({ 0x69, 0xc9 });
+	emit32(Mmu::TLB_WAYS * sizeof(Entry));
+	// rsi = &dtlb.entries[set]; rdi = page of rax
+	mov(Reg::RSI, reinterpret_cast<uint64_t>(mmu->dtlb.entries.data()));
+	emit({ 0x48, 0x01, 0xce, 0x48, 0x89, 0xc7, 0x48, 0x81, 0xe7 });
+	emit32(static_cast<uint32_t>(Mmu::PAGE_MASK));
+	// rcx = generation; r8 = asid; edx = ways left
+	mov(Reg::RCX, reinterpret_cast<uint64_t>(&mmu->generation));
+	emit({ 0x48, 0x8b, 0x09 });
+	mov(Reg::R8, reinterpret_cast<uint64_t>(&mmu->asid));
+	emit({ 0x4d, 0x8b, 0x00, 0xba });
+	emit32(Mmu::TLB_WAYS);
+
+	uint64_t way = buf.size();
+
+	// cmp [rsi + generation], rcx
+	emit({ 0x48, 0x39, 0x8e });
+	emit32(offsetof(Entry, generation));
+	uint64_t stale = jump(Cond::NE);
+	// cmp [rsi + virt_base], rdi
+	emit({ 0x48, 0x39, 0xbe });
+	emit32(offsetof(Entry, virt_base));
+	uint64_t other = jump(Cond::NE);
+	// cmp byte [rsi + is_global], 0
+	emit({ 0x80, 0xbe });
+	emit32(offsetof(Entry, is_global));
+	emit({ 0x00 });
+	uint64_t global = jump(Cond::NE);
+	// cmp [rsi + asid], r8
+	emit({ 0x4c, 0x39, 0x86 });
+	emit32(offsetof(Entry, asid));
+	uint64_t hit = jump(Cond::E);
+
+	bind(stale);
+	bind(other);
+	// add rsi, entry size; dec edx; jnz way
+	emit({ 0x48, 0x81, 0xc6 });
+	emit32(sizeof(Entry));
+	emit({ 0xff, 0xca });
+	jump_to(Cond::NE, way);
+
+	// xor edx, edx; ret
+	uint64_t miss = buf.size();
+	emit({ 0x31, 0xd2, 0xc3 });
+
+	bind(global);
+	bind(hit);
+	// movzx ecx, byte [rsi + perms]; movzx edi, word [allowed]; bt edi, ecx
+	emit({ 0x0f, 0xb6, 0x8e });
+	emit32(offsetof(Entry, perms));
+	mov(Reg::RDI, reinterpret_cast<uint64_t>(&mmu->allowed[access_type]));
+	emit({ 0x0f, 0xb7, 0x3f, 0x0f, 0xa3, 0xcf });
+	jump_to(Cond::AE, miss);
+
+	// A and D are set by Mmu::translate
+	emit({ 0x80, 0xbe });
+	emit32(offsetof(Entry, is_accessed));
+	emit({ 0x00 });
+	jump_to(Cond::E, miss);
+
+	if (access_type == Mmu::AccessType::STORE) {
+		emit({ 0x80, 0xbe });
+		emit32(offsetof(Entry, is_dirty));
+		emit({ 0x00 });
+		jump_to(Cond::E, miss);
+	}
+
+	// mov rdx, [rsi + host]; test rdx, rdx
+	emit({ 0x48, 0x8b, 0x96 });
+	emit32(offsetof(Entry, host));
+	emit({ 0x48, 0x85, 0xd2 });
+	jump_to(Cond::E, miss);
+	// mov ecx, eax; and ecx, offset mask; add rdx, rcx
+	emit({ 0x89, 0xc1, 0x81, 0xe1 });
+	emit32(~Mmu::PAGE_MASK);
+	emit({ 0x48, 0x01, 0xca });
+	uint64_t found = jump(Cond::ALWAYS);
+
+	// Physical addresses, only whole pages of DRAM
+	bind(bare);
+	bind(machine);
+
+	if (dram->size < Mmu::PAGE_SIZE)
+		jump_to(Cond::ALWAYS, miss);
+	else {
+		// rdx = rax - base; rcx = page of rdx
+		emit({ 0x48, 0x89, 0xc2 });
+		mov(Reg::RCX, dram->base);
+		emit({ 0x48, 0x29, 0xca, 0x48, 0x89, 0xd1, 0x48, 0x81, 0xe1 });
+		emit32(static_cast<uint32_t>(Mmu::PAGE_MASK));
+		// cmp rcx, size - page; ja miss
+		mov(Reg::RDI, dram->size - Mmu::PAGE_SIZE);
+		emit({ 0x48, 0x39, 0xf9 });
+		jump_to(Cond::A, miss);
+		// add rdx, host
+		mov(Reg::RCX, host);
+		emit({ 0x48, 0x01, 0xca });
+	}
+
+	bind(found);
+
+	// Stores to translated code go through the Mmu,
+	// which drops the blocks of the page
+	if (access_type == Mmu::AccessType::STORE) {
+		// mov rcx, rdx; sub rcx, host; shr rcx, 12
+		emit({ 0x48, 0x89, 0xd1 });
+		mov(Reg::RDI, host);
+		emit({ 0x48, 0x29, 0xf9, 0x48, 0xc1, 0xe9, 0x0c });
+		// cmp byte [rdi + rcx], 0
+		mov(Reg::RDI, reinterpret_cast<uint64_t>(code_pages));
+		emit({ 0x80, 0x3c, 0x0f, 0x00 });
+		jump_to(Cond::NE, miss);
+	}
+
+	emit({ 0xc3 });
+}
+
+void Jit::memory(const Instruction::Op& op, uint64_t kind,
+	uint64_t delta, uint64_t retired)
+{
+	using Kind = Instruction::Kind;
+
+	static constexpr uint8_t sizes[] = { 1, 2, 4, 8, 1, 2, 4, 1, 2, 4, 8 };
+
+	bool is_store = kind >= Kind::SB;
+	uint8_t size = sizes[kind - Kind::LB];
+
+	load(Reg::RAX, op.rs1);
+	alu_imm(0x05, op.imm);
+
+	// A misaligned access may cross a page, the handler splits it
+	uint64_t misaligned = 0;
+
+	if (size > 1) {
+		// test al, size - 1
+		emit({ 0xa8, static_cast<uint8_t>(size - 1) });
+		misaligned = jump(Cond::NE);
+	}
+
+	uint8_t *target = probes[is_store ? 
+		Mmu::AccessType::STORE : Mmu::AccessType::LOAD];
+
+	// call probe; test rdx, rdx
+	emit({ 0xe8 });
+	emit32(target - (code + used + buf.size() + 4));
+	emit({ 0x48, 0x85, 0xd2 });
+	uint64_t miss = jump(Cond::E);
+
+	if (is_store)
+		load(Reg::RAX, op.rs2);
+
+	switch (kind) {
+	case Kind::LB: emit({ 0x48, 0x0f, 0xbe, 0x02 }); break;
+	case Kind::LH: emit({ 0x48, 0x0f, 0xbf, 0x02 }); break;
+	case Kind::LW: emit({ 0x48, 0x63, 0x02 }); break;
+	case Kind::LD: emit({ 0x48, 0x8b, 0x02 }); break;
+	case Kind::LBU: emit({ 0x0f, 0xb6, 0x02 }); break;
+	case Kind::LHU: emit({ 0x0f, 0xb7, 0x02 }); break;
+	case Kind::LWU: emit({ 0x8b, 0x02 }); break;
+	case Kind::SB: emit({ 0x88, 0x02 }); break;
+	case Kind::SH: emit({ 0x66, 0x89, 0x02 }); break;
+	case Kind::SW: emit({ 0x89, 0x02 }); break;
+	case Kind::SD: emit({ 0x48, 0x89, 0x02 }); break;
+	}
+
+	if (!is_store && op.rd)
+		store(Reg::RAX, op.rd);
+
+	uint64_t done = jump(Cond::ALWAYS);
+
+	if (size > 1)
+		bind(misaligned);
+
+	bind(miss);
+
+	// The handler sees the pc of the op and moves past it,
+	// back on the fast path that is left to the block again
+	add_pc(delta);
+	call(op, access);
+	// test al, al
+	emit({ 0x84, 0xc0 });
+	uint64_t next = jump(Cond::E);
+	leave(retired + 1);
+
+	bind(next);
+	add_pc(-static_cast<int64_t>(delta + op.size));
+	bind(done);
+}
+
+bool Jit::native(const Instruction::Op& op, uint64_t& delta,
+	uint64_t retired)
+{
+	using Kind = Instruction::Kind;
+
+	uint64_t kind = Instruction::kind(op);
+	int64_t imm = op.imm;
+
+	switch (kind) {
+	case Kind::BEQ: case Kind::BNE:
+	case Kind::BLT: case Kind::BGE:
+	case Kind::BLTU: case Kind::BGEU:
+	{
+		static constexpr uint8_t conds[] = {
+			Cond::E, Cond::NE, Cond::L, Cond::GE, Cond::B, Cond::AE
+		};
+
+		load(Reg::RAX, op.rs1);
+		alu(0x3b, op.rs2);
+
+		uint64_t taken = jump(conds[kind - Kind::BEQ]);
+
+		leave_to(delta, op.size, retired + 1);
+
+		bind(taken);
+		leave_to(delta, imm, retired + 1);
+		return true;
+	}
+	case Kind::JAL:
+		if (op.rd) {
+			// mov rax, [rbp]
+			emit({ 0x48, 0x8b, 0x45, 0x00 });
+			add_rax(delta + op.size);
+			store(Reg::RAX, op.rd);
+		}
+
+		leave_to(delta, imm, retired + 1);
+		return true;
+	case Kind::JALR:
+		load(Reg::RAX, op.rs1);
+		add_rax(imm);
+		// and rax, -2
+		emit({ 0x48, 0x83, 0xe0, 0xfe });
+
+		if (op.rd) {
+			// mov rcx, [rbp]; add rcx, imm32
+			emit({ 0x48, 0x8b, 0x4d, 0x00 });
+			emit({ 0x48, 0x81, 0xc1 });
+			emit32(delta + op.size);
+			store(Reg::RCX, op.rd);
+		}
+
+		// mov [rbp], rax
+		emit({ 0x48, 0x89, 0x45, 0x00 });
+		leave(retired + 1);
+		return true;
+	case Kind::LB: case Kind::LH: case Kind::LW: case Kind::LD:
+	case Kind::LBU: case Kind::LHU: case Kind::LWU:
+	case Kind::SB: case Kind::SH: case Kind::SW: case Kind::SD:
+		memory(op, kind, delta, retired);
+		break;
+	case Kind::NOP:
+		break;
+	default:
+		if (kind == Kind::NONE || kind == Kind::END)
+			return false;
+
+		if (!op.rd)
+			break;
+
+		switch (kind) {
+		case Kind::ADD: load(Reg::RAX, op.rs1); alu(0x03, op.rs2); break;
+		case Kind::SUB: load(Reg::RAX, op.rs1); alu(0x2b, op.rs2); break;
+		case Kind::XOR: load(Reg::RAX, op.rs1); alu(0x33, op.rs2); break;
+		case Kind::OR: load(Reg::RAX, op.rs1); alu(0x0b, op.rs2); break;
+		case Kind::AND: load(Reg::RAX, op.rs1); alu(0x23, op.rs2); break;
+		case Kind::SLT:
+			load(Reg::RAX, op.rs1);
+			alu(0x3b, op.rs2);
+			set(Cond::L);
+			break;
+		case Kind::SLTU:
+			load(Reg::RAX, op.rs1);
+			alu(0x3b, op.rs2);
+			set(Cond::B);
+			break;
+		case Kind::SLL:
+		case Kind::SRL:
+		case Kind::SRA:
+			load(Reg::RAX, op.rs1);
+			load(Reg::RCX, op.rs2);
+			shift(kind == Kind::SLL ? 4 : kind == Kind::SRL ? 5 : 7);
+			break;
+		case Kind::MUL:
+			// imul rax, [rbx + rs2 * 8]
+			load(Reg::RAX, op.rs1);
+			emit({ 0x48, 0x0f, 0xaf, 0x83 });
+			emit32(op.rs2 * 8);
+			break;
+		case Kind::ADDW:
+		case Kind::SUBW:
+			load(Reg::RAX, op.rs1);
+			alu(kind == Kind::ADDW ? 0x03 : 0x2b, op.rs2, false);
+			break;
+		case Kind::SLLW:
+		case Kind::SRLW:
+		case Kind::SRAW:
+			load(Reg::RAX, op.rs1);
+			load(Reg::RCX, op.rs2);
+			shift(kind == Kind::SLLW ? 4 : kind == Kind::SRLW ? 5 : 7, false);
+			break;
+		case Kind::MULW:
+			// imul eax, [rbx + rs2 * 8]
+			load(Reg::RAX, op.rs1);
+			emit({ 0x0f, 0xaf, 0x83 });
+			emit32(op.rs2 * 8);
+			break;
+		case Kind::ADDI: load(Reg::RAX, op.rs1); alu_imm(0x05, imm); break;
+		case Kind::XORI: load(Reg::RAX, op.rs1); alu_imm(0x35, imm); break;
+		case Kind::ORI: load(Reg::RAX, op.rs1); alu_imm(0x0d, imm); break;
+		case Kind::ANDI: load(Reg::RAX, op.rs1); alu_imm(0x25, imm); break;
+		case Kind::SLTI:
+			load(Reg::RAX, op.rs1);
+			alu_imm(0x3d, imm);
+			set(Cond::L);
+			break;
+		case Kind::SLTIU:
+			load(Reg::RAX, op.rs1);
+			alu_imm(0x3d, imm);
+			set(Cond::B);
+			break;
+		case Kind::SLLI: load(Reg::RAX, op.rs1); shift_imm(4, imm & 0x3f); break;
+		case Kind::SRLI: load(Reg::RAX, op.rs1); shift_imm(5, imm & 0x3f); break;
+		case Kind::SRAI: load(Reg::RAX, op.rs1); shift_imm(7, imm & 0x3f); break;
+		case Kind::ADDIW:
+			load(Reg::RAX, op.rs1);
+			alu_imm(0x05, imm, false);
+			break;
+		case Kind::SLLIW: load(Reg::RAX, op.rs1); shift_imm(4, imm & 0x3f); break;
+		case Kind::SRLIW: load(Reg::RAX, op.rs1); shift_imm(5, imm & 0x1f, false); break;
+		case Kind::SRAIW: load(Reg::RAX, op.rs1); shift_imm(7, imm & 0x1f, false); break;
+		case Kind::LUI:
+			// mov rax, imm32
+			emit({ 0x48, 0xc7, 0xc0 });
+			emit32(imm);
+			break;
+		case Kind::AUIPC:
+			// mov rax, [rbp]
+			emit({ 0x48, 0x8b, 0x45, 0x00 });
+			add_rax(delta + imm);
+			break;
+		default:
+			return false;
+		}
+
+		switch (kind) {
+		case Kind::ADDW: case Kind::SUBW: case Kind::MULW:
+		case Kind::SLLW: case Kind::SRLW: case Kind::SRAW:
+		case Kind::ADDIW: case Kind::SLLIW:
+		case Kind::SRLIW: case Kind::SRAIW:
+			// movsxd rax, eax
+			emit({ 0x48, 0x63, 0xc0 });
+			break;
+		}
+
+		store(Reg::RAX, op.rd);
+		break;
+	}
+
+	delta += op.size;
+	return true;
+}
+
+uint8_t *Jit::install(void)
+{
+#ifdef EMU_JIT
+	if (used + buf.size() > CODE_SIZE) {
+		full = true;
+		return nullptr;
+	}
+
+	static const uint64_t page = sysconf(_SC_PAGESIZE);
+
+	uint8_t *entry = code + used;
+	uint8_t *first = code + (used & ~(page - 1));
+	uint64_t len = (entry + buf.size()) - first;
+
+	if (mprotect(first, len, PROT_READ | PROT_WRITE)) {
+		full = true;
+		return nullptr;
+	}
+
+	std::memcpy(entry, buf.data(), buf.size());
+	mprotect(first, len, PROT_READ | PROT_EXEC);
+	used += buf.size();
+
+	return entry;
+#else
+	return nullptr;
+#endif
+}
+
+Jit::code_t Jit::compile(const std::vector<Instruction::Op>& ops,
+	uint64_t addr, const uint8_t *code_pages)
+{
+#ifdef EMU_JIT
+	if (!code) {
+		// Never writable and executable at once, compile()
+		// opens up only the pages it is about to fill
+		void *mem = mmap(
+			nullptr, CODE_SIZE,
+			PROT_READ | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+		);
+
+		if (mem == MAP_FAILED)
+			return nullptr;
+
+		code = static_cast<uint8_t*>(mem);
+		slots.assign(MAX_LINKS, 0);
+	}
+
+	// The probes go first and are dropped with the buffer
+	if (!used)
+		for (uint64_t type : { Mmu::AccessType::LOAD, Mmu::AccessType::STORE }) {
+			buf.clear();
+			probe(type, code_pages);
+
+			if (!(probes[type] = install()))
+				return nullptr;
+		}
+
+	buf.clear();
+	exits.clear();
+	links.clear();
+
+	start = addr;
+	offset = 0;
+
+	// SYSTEM ops may switch the translation or wait
+	// for an interrupt, blocks with one always return
+	linkable = std::none_of(ops.begin(), ops.end(),
+		[](const Instruction::Op& op) {
+			return (op.insn & 0x7f) == 0x73;
+		});
+
+	// push rbx; push rbp; push r12
+	emit({ 0x53, 0x55, 0x41, 0x54 });
+	// mov rbx, &int_regs; mov rbp, &pc; xor r12d, r12d
+	emit({ 0x48, 0xbb });
+	emit64(reinterpret_cast<uint64_t>(&cpu->int_regs[0]));
+	emit({ 0x48, 0xbd });
+	emit64(reinterpret_cast<uint64_t>(&cpu->pc));
+	emit({ 0x45, 0x31, 0xe4 });
+
+	// Chained blocks enter here, r12 holds
+	// what the blocks before them retired
+	if (buf.size() != BODY)
+		return nullptr;
+
+	// mov qword [rbx], 0
+	emit({ 0x48, 0xc7, 0x03 });
+	emit32(0);
+
+	uint64_t delta = 0;
+	uint64_t retired = 0;
+	bool closed = false;
+
+	for (const Instruction::Op& op : ops) {
+		uint64_t kind = Instruction::kind(op);
+
+		if (kind == Instruction::Kind::END)
+			break;
+
+		if (native(op, delta, retired)) {
+			retired++;
+			offset += op.size;
+
+			if (kind >= Instruction::Kind::JAL) {
+				closed = true;
+				break;
+			}
+
+			continue;
+		}
+
+		add_pc(delta);
+		delta = 0;
+		call(op, step);
+		offset += op.size;
+
+		// test al, al
+		emit({ 0x84, 0xc0 });
+		uint64_t next = jump(Cond::E);
+		leave(retired);
+		bind(next);
+	}
+
+	if (!closed) {
+		add_pc(delta);
+		leave(retired);
+	}
+
+	uint64_t epilogue = buf.size();
+
+	// pop r12; pop rbp; pop rbx; ret
+	emit({ 0x41, 0x5c, 0x5d, 0x5b, 0xc3 });
+
+	for (uint64_t exit : exits) {
+		uint32_t rel = epilogue - (exit + 4);
+		std::memcpy(buf.data() + exit, &rel, sizeof(rel));
+	}
+
+	return reinterpret_cast<code_t>(install());
+#else
+	return nullptr;
+#endif
+}
@@ -0,0 +1,47 @@
+#include <thread>
+#include <mutex>
+#include <exception>
+#include "machine.hpp"
+
+using namespace Emulator;
+
+void Machine::run(void)
+{
+	std::vector<std::thread> threads;
+	std::exception_ptr failure;
+	std::mutex failure_lock;
+
+	auto hart = [&](uint64_t hartid) {
+		bind(hartid);
+
+		try {
+			while (running.load(std::memory_order_relaxed))
+				cpu->iterate();
+		} catch (...) {
+			std::scoped_lock guard(failure_lock);
+
+			if (!failure)
+				failure = std::current_exception();
+
+			running = false;
+		}
+	};
+
+	running = true;
+
+	for (uint64_t hartid = 1; hartid < harts.size(); hartid++)
+		threads.emplace_back(hart, hartid);
+
+	hart(0);
+
+	for (std::thread& thread : threads)
+		thread.join();
+
+	for (Hart& h : harts)
+		h.cpu->dump_stats();
+
+	bind();
+
+	if (failure)
+		std::rethrow_exception(failure);
+}
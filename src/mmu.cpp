@@ -1,53 +1,190 @@
+#include <atomic>
 #include "common.hpp"
+#include "dram.hpp"
 #include "mmu.hpp"
 
 using namespace Emulator;
 
 uint64_t Mmu::load(uint64_t addr, uint64_t len)
 {
-	uint64_t p_addr = translate(addr, AccessType::LOAD);
-
-	if (cpu->exception.current != Exception::NONE)
-		return 0;
-	
-	uint64_t value = bus->load(p_addr, len);
-	return value;
+	switch (len) {
+	case 8: return load<8>(addr);
+	case 16: return load<16>(addr);
+	case 32: return load<32>(addr);
+	case 64: return load<64>(addr);
+	default: return 0;
+	}
 }
 
 void Mmu::store(uint64_t addr, uint64_t value, uint64_t len)
 {
-	uint64_t p_addr = translate(addr, AccessType::STORE);
+	switch (len) {
+	case 8: store<8>(addr, value); break;
+	case 16: store<16>(addr, value); break;
+	case 32: store<32>(addr, value); break;
+	case 64: store<64>(addr, value); break;
+	default: break;
+	}
+}
+
+uint64_t Mmu::refill(uint64_t addr, uint8_t *&host)
+{
+	uint64_t p_addr = translate(addr, AccessType::INSTRUCTION, host);
 
 	if (cpu->exception.current != Exception::NONE)
-		return;
+		return 0;
 
-	bus->store(p_addr, value, len);
+	fetch_buffer.page = addr & PAGE_MASK;
+	fetch_buffer.phys = p_addr & PAGE_MASK;
+	fetch_buffer.host = host ? host - (addr & ~PAGE_MASK) : nullptr;
+
+	return p_addr;
 }
 
-uint64_t Mmu::fetch(uint64_t addr, uint64_t len)
+uint32_t Mmu::fetch(uint64_t addr)
 {
-	uint64_t p_addr = translate(addr, AccessType::INSTRUCTION);
+	uint8_t *host;
+	uint64_t p_addr = translate_fetch(addr, host);
+
 	if (cpu->exception.current != Exception::NONE)
 		return 0;
-	
-	uint64_t value = bus->load(p_addr, len);
+
+	if (host && (addr & ~PAGE_MASK) + 4 <= PAGE_SIZE) {
+		uint32_t insn;
+		std::memcpy(&insn, host, sizeof(insn));
+		return insn;
+	}
+
+	// Parcel by parcel, the upper half of an instruction
+	// at the end of a page may live on another page
+	uint64_t insn = bus->load<16>(p_addr);
+
+	if (cpu->exception.current == Exception::NONE && (insn & 0x3) == 0x3) {
+		p_addr = translate_fetch(addr + 2, host);
+
+		if (cpu->exception.current != Exception::NONE)
+			return 0;
+
+		insn |= bus->load<16>(p_addr) << 16;
+	}
+
 	if (cpu->exception.current == Exception::LOAD_ACCESS_FAULT)
 		cpu->exception.current = Exception::INSTRUCTION_ACCESS_FAULT;
 	
-	return value;
+	return insn;
 }
 
 void Mmu::update(void)
 {
 	uint64_t satp = cpu->csr_regs.load(CRegs::Address::SATP);
+	uint64_t mstatus = cpu->csr_regs.load(CRegs::Address::MSTATUS);
+	uint64_t next_mode = read_bits(satp, 63, 60);
 
 	mppn = read_bits(satp, 43, 0) << 12ULL;
-	mode = read_bits(satp, 63, 60);
+	asid = read_bits(satp, 59, 44);
+
+	// Entries carry their ASID, so only switching
+	// the translation scheme makes them unusable
+	if (next_mode != mode) {
+		mode = next_mode;
+		flush_tlb();
+	}
+
+	fetch_mode = cpu->mode;
+	data_mode = cpu->mode;
+	fetch_buffer = {};
+
+	if (read_bit(mstatus, CRegs::Mstatus::MPRV)) {
+		data_mode = read_bits(mstatus, 12, 11);
+
+		if (data_mode != Cpu::Mode::USER &&
+			data_mode != Cpu::Mode::SUPERVISOR &&
+			data_mode != Cpu::Mode::MACHINE)
+		{
+			data_mode = Cpu::Mode::INVALID;
+		}
+	}
+
+	bool mxr = read_bit(mstatus, CRegs::Mstatus::MXR);
+	bool sum = read_bit(mstatus, CRegs::Mstatus::SUM);
+
+	allowed = {};
+
+	for (uint64_t perms = 0; perms < 16; perms++) {
+		bool is_read = perms & Perm::READ;
+		bool is_write = perms & Perm::WRITE;
+		bool is_execute = perms & Perm::EXECUTE;
+		bool is_user = perms & Perm::USER;
+
+		if (!is_read && is_write)
+			continue;
 
-	flush_tlb();
+		auto privileged = [&](uint64_t cpu_mode, bool is_fetch) {
+			if (is_user)
+				return cpu_mode == Cpu::Mode::USER ||
+					(cpu_mode == Cpu::Mode::SUPERVISOR && sum && !is_fetch);
+
+			return cpu_mode == Cpu::Mode::SUPERVISOR;
+		};
+
+		if (privileged(data_mode, false)) {
+			if (is_read || (is_execute && mxr))
+				allowed[AccessType::LOAD] |= 1U << perms;
+
+			if (is_write)
+				allowed[AccessType::STORE] |= 1U << perms;
+		}
+
+		if (privileged(fetch_mode, true) && is_execute)
+			allowed[AccessType::INSTRUCTION] |= 1U << perms;
+	}
+}
+
+void Mmu::flush_tlb(bool by_addr, uint64_t addr, bool by_asid, uint64_t asid)
+{
+	if (!by_addr && !by_asid) {
+		flush_tlb();
+		return;
+	}
+
+	fetch_buffer = {};
+
+	asid = read_bits(asid, 15, 0);
+
+	auto flush = [&](TLBEntry& entry) {
+		if (entry.generation == generation &&
+			(!by_addr || entry.virt_base == (addr & entry.page_mask)) &&
+			(!by_asid || (!entry.is_global && entry.asid == asid)))
+		{
+			entry.generation = 0;
+		}
+	};
+
+	for (TLB *tlb : {&itlb, &dtlb}) {
+		if (by_addr) {
+			uint64_t set = (addr >> 12ULL) % TLB_SETS;
+
+			for (uint64_t i = 0; i < TLB_WAYS; i++)
+				flush(tlb->entries[set * TLB_WAYS + i]);
+		} else
+			for (TLBEntry& entry : tlb->entries)
+				flush(entry);
+
+		for (TLBEntry& entry : tlb->large)
+			flush(entry);
+	}
+
+	// Flushing by address covers leaf entries only
+	if (by_addr)
+		return;
+
+	for (auto& level : walk_cache)
+		for (WalkEntry& entry : level)
+			if (!entry.is_global && entry.asid == asid)
+				entry.generation = 0;
 }
 
-bool Mmu::fetch_pte(uint64_t addr, uint64_t access_type, uint64_t cpu_mode, TLBEntry& entry)
+bool Mmu::fetch_pte(uint64_t addr, uint64_t access_type, TLBEntry& entry)
 {
 	std::array<uint64_t, 5> vpn = get_vpn(addr);
 	uint64_t levels = get_levels();
@@ -56,10 +193,32 @@ bool Mmu::fetch_pte(uint64_t addr, uint64_t access_type, uint64_t cpu_mode, TLBE
 	uint64_t tmp = mppn;
 	int64_t i = levels - 1;
 
+	entry.is_global = false;
+
+	for (int64_t j = 0; j < i; j++) {
+		uint64_t prefix = get_prefix(addr, j);
+		WalkEntry& walk = walk_cache[j][prefix % WALK_ENTRIES];
+
+		if (walk.generation == generation && walk.prefix == prefix &&
+			(walk.is_global || walk.asid == asid))
+		{
+			tmp = walk.table;
+			entry.is_global = walk.is_global;
+			i = j;
+			break;
+		}
+	}
+
 	for (; i >= 0; i--) {
 		entry.pte_addr = tmp + vpn[i] * PTE_SIZE;
-		entry.pte = bus->load(entry.pte_addr, 64);
+
+		uint8_t *host = get_host(entry.pte_addr);
+		entry.pte = host ?
+			*reinterpret_cast<uint64_t*>(host) :
+			bus->load<64>(entry.pte_addr);
 		
+		entry.is_global |= (entry.pte >> PteValue::GLOBAL) & 1;
+
 		entry.is_read = (entry.pte >> PteValue::READ) & 1;
 		entry.is_write = (entry.pte >> PteValue::WRITE) & 1;
 		entry.is_execute = (entry.pte >> PteValue::EXECUTE) & 1;
@@ -75,6 +234,14 @@ bool Mmu::fetch_pte(uint64_t addr, uint64_t access_type, uint64_t cpu_mode, TLBE
 			break;
 
 		tmp = ((entry.pte >> 10ULL) & 0xfffffffffffULL) * PAGE_SIZE;
+
+		if (i > 0) {
+			uint64_t prefix = get_prefix(addr, i - 1);
+			
+			walk_cache[i - 1][prefix % WALK_ENTRIES] = {
+				prefix, tmp, asid, generation, entry.is_global
+			};
+		}
 	}
 
 	if (i < 0) {
@@ -91,171 +258,189 @@ bool Mmu::fetch_pte(uint64_t addr, uint64_t access_type, uint64_t cpu_mode, TLBE
 		}
 
 	entry.is_user = (entry.pte >> PteValue::USER) & 1;
+	entry.perms = (entry.pte >> PteValue::READ) & 0xfULL;
 	entry.is_accessed = (entry.pte >> PteValue::ACCESSED) & 1;
 	entry.is_dirty = (entry.pte >> PteValue::DIRTY) & 1;
 
+	bool napot = (entry.pte >> PteValue::NAPOT) & 1;
+
 	if (i) {
-		entry.phys_base = 0;
+		if (napot) {
+			set_cpu_error(addr, access_type);
+			return false;
+		}
 
-		for (uint64_t j = 0; j < i; j++)
-			entry.phys_base |= vpn[j] << (12ULL + (j * 9ULL));
+		entry.page_mask = ~((PAGE_SIZE << (i * 9ULL)) - 1);
+		entry.phys_base = 0;
 
 		for (uint64_t j = i; j < levels; j++)
 			entry.phys_base |= ppn[j] << (12ULL + (j * 9ULL));
-	} else
+	} else {
+		entry.page_mask = PAGE_MASK;
 		entry.phys_base = ((entry.pte >> 10ULL) & 0xfffffffffffULL) << 12ULL;
+
+		// Svnapot, only 64 KiB ranges are defined
+		if (napot) {
+			if ((ppn[0] & 0xfULL) != 0x8ULL) {
+				set_cpu_error(addr, access_type);
+				return false;
+			}
+
+			entry.page_mask = NAPOT_MASK;
+			entry.phys_base &= NAPOT_MASK;
+		}
+	}
 	
 	return true;
 }
 
-Mmu::TLBEntry *Mmu::get_tlb_entry(uint64_t addr, uint64_t access_type, uint64_t cpu_mode)
+uint8_t *Mmu::get_host(uint64_t p_addr, uint64_t page_mask)
 {
-	uint64_t addr_masked = addr & ~0xfffULL;
-	uint64_t oldest_tlb_age = 0;
-	int oldest_tlb_index = 0;
-
-	for (int i = 0; i < tlb_cache.size(); i++) {
-		TLBEntry& entry = tlb_cache[i];
+	Dram *dram = static_cast<Dram*>(bus->get(DeviceName::DRAM));
 
-		if (addr_masked == entry.virt_base) {
-			entry.age = 0;
+	if (!dram || !dram->contains(p_addr & page_mask, ~page_mask + 1))
+		return nullptr;
 
-			while (++i < tlb_cache.size())
-				++tlb_cache[i].age;
+	return dram->host(p_addr);
+}
 
+Mmu::TLBEntry *Mmu::get_tlb_entry(uint64_t addr, uint64_t access_type)
+{
+	TLB& tlb = (access_type == AccessType::INSTRUCTION) ? itlb : dtlb;
+	uint64_t addr_masked = addr & PAGE_MASK;
+	uint64_t set = (addr >> 12ULL) % TLB_SETS;
+	TLBEntry *ways = &tlb.entries[set * TLB_WAYS];
+
+	for (uint64_t i = 0; i < TLB_WAYS; i++) {
+		TLBEntry& entry = ways[i];
+
+		if (entry.generation == generation &&
+			entry.virt_base == addr_masked &&
+			(entry.is_global || entry.asid == asid))
+		{
 			return &entry;
 		}
+	}
 
-		++entry.age;
-
-		if (entry.age > oldest_tlb_age) {
-			oldest_tlb_age = entry.age;
-			oldest_tlb_index = i;
+	for (TLBEntry& entry : tlb.large) {
+		if (entry.generation == generation &&
+			entry.virt_base == (addr & entry.page_mask) &&
+			(entry.is_global || entry.asid == asid))
+		{
+			return &entry;
 		}
 	}
 
-	TLBEntry& entry = tlb_cache[oldest_tlb_index];
+	TLBEntry walked;
 	
-	if (fetch_pte(addr, access_type, cpu_mode, entry)) {
-		entry.virt_base = addr_masked;
-		entry.age = 0;
-		return &entry;
+	if (!fetch_pte(addr, access_type, walked))
+		return nullptr;
+
+	walked.host = get_host(walked.phys_base, walked.page_mask);
+
+	// A large page only partly backed by DRAM is cached 4 KiB at
+	// a time, so that its DRAM part still gets a host pointer
+	if (walked.page_mask != PAGE_MASK && !walked.host) {
+		walked.phys_base |= addr & ~walked.page_mask & PAGE_MASK;
+		walked.page_mask = PAGE_MASK;
+		walked.host = get_host(walked.phys_base);
+	}
+
+	walked.virt_base = addr & walked.page_mask;
+	walked.asid = asid;
+	walked.generation = generation;
+
+	if (walked.page_mask != PAGE_MASK) {
+		TLBEntry& entry = tlb.large[tlb.large_victim];
+		tlb.large_victim = (tlb.large_victim + 1) % TLB_LARGE;
+
+		return &(entry = walked);
 	}
 
-	return nullptr;
+	TLBEntry& entry = ways[tlb.victim[set]];
+	tlb.victim[set] = (tlb.victim[set] + 1) % TLB_WAYS;
+
+	return &(entry = walked);
 }
 
-uint64_t Mmu::translate(uint64_t addr, uint64_t access_type)
+// Sets A, and D for a store, only if the PTE in memory still
+// is the one cached, other harts may update or remap it meanwhile
+bool Mmu::set_accessed(TLBEntry& entry, uint64_t access_type)
 {
-	if (mode == ModeValue::BARE)
-		return addr;
-	
-	uint64_t cpu_mode = cpu->mode;
-	
-	uint64_t mprv = read_bit(
-		cpu->csr_regs.load(
-			CRegs::Address::MSTATUS
-		),
-		CRegs::Mstatus::MPRV
-	);
-
-	if (access_type != AccessType::INSTRUCTION && (mprv == 1))
-	{
-		uint64_t mpp = read_bits(
-			cpu->csr_regs.load(
-				CRegs::Address::MSTATUS
-			), 
-			12, 11
-		);
-		
-		switch (mpp) {
-		case Cpu::Mode::USER:
-		case Cpu::Mode::SUPERVISOR:
-		case Cpu::Mode::MACHINE:
-			cpu_mode = mpp;
-			break;
-		default:
-			cpu_mode = Cpu::Mode::INVALID;
-			break;
-		}
-	}
+	uint64_t bits = 1ULL << PteValue::ACCESSED;
 
-	if (cpu_mode == Cpu::Mode::MACHINE)
-		return addr;
-	
-	TLBEntry *entry = get_tlb_entry(addr, access_type, cpu_mode);
-	if (!entry)
-		return 0;
-	
-	bool mxr = read_bit(
-		cpu->csr_regs.load(
-			CRegs::Address::MSTATUS
-		), 
-		CRegs::Mstatus::MXR
-	);
-	bool sum = read_bit(
-		cpu->csr_regs.load(
-			CRegs::Address::MSTATUS
-		), 
-		CRegs::Mstatus::SUM
-	);
-
-	if ((!entry->is_read && entry->is_write && !entry->is_execute) ||
-		(!entry->is_read && entry->is_write && entry->is_execute)) 
-	{
-		set_cpu_error(addr, access_type);
-		return 0;
-	}
+	if (access_type == AccessType::STORE)
+		bits |= 1ULL << PteValue::DIRTY;
 
-	if (entry->is_user && 
-		((cpu_mode != Cpu::Mode::USER) &&
-		 (!sum || access_type == AccessType::INSTRUCTION)))
-	{
-		set_cpu_error(addr, access_type);
-		return 0;
+	uint8_t *host = get_host(entry.pte_addr);
+
+	if (host) {
+		std::atomic_ref<uint64_t> word(*reinterpret_cast<uint64_t*>(host));
+		uint64_t expected = entry.pte;
+
+		if (!word.compare_exchange_strong(expected, entry.pte | bits))
+			return false;
+
+		cpu->block_cache.invalidate(entry.pte_addr);
+	} else {
+		std::unique_lock<std::recursive_mutex> lock = bus->lock();
+
+		if (bus->load<64>(entry.pte_addr) != entry.pte)
+			return false;
+
+		bus->store<64>(entry.pte_addr, entry.pte | bits);
 	}
 
-	if (!entry->is_user && (cpu_mode != Cpu::Mode::SUPERVISOR)) {
-		set_cpu_error(addr, access_type);
-		return 0;
+	entry.pte |= bits;
+	entry.is_accessed = true;
+	entry.is_dirty |= access_type == AccessType::STORE;
+
+	return true;
+}
+
+uint64_t Mmu::translate(uint64_t addr, uint64_t access_type, uint8_t *&host)
+{
+	host = nullptr;
+
+	uint64_t cpu_mode = (access_type == AccessType::INSTRUCTION) ?
+		fetch_mode : data_mode;
+
+	if (mode == ModeValue::BARE || cpu_mode == Cpu::Mode::MACHINE) {
+		host = get_host(addr);
+		return addr;
 	}
+	
+	TLBEntry *entry;
 
-	switch (access_type) {
-	case AccessType::LOAD:
-		if (!(entry->is_read || (entry->is_execute && mxr))) {
-			set_cpu_error(addr, access_type);
-			return 0;
-		}
-		break;
-	case AccessType::STORE:
-		if (!entry->is_write) {
-			set_cpu_error(addr, access_type);
+	for (;;) {
+		entry = get_tlb_entry(addr, access_type);
+		if (!entry)
 			return 0;
-		}
-		break;
-	case AccessType::INSTRUCTION:
-		if (!entry->is_execute) {
+
+		if (!((allowed[access_type] >> entry->perms) & 1)) {
 			set_cpu_error(addr, access_type);
 			return 0;
 		}
-		break;
-	}
-
-	if (!entry->is_accessed || (access_type == AccessType::STORE && !entry->is_dirty)) {
-		entry->pte |= 1ULL << PteValue::ACCESSED;
-		entry->is_accessed = true;
 
-		if (access_type == AccessType::STORE) {
-			entry->pte |= 1ULL << PteValue::DIRTY;
-			entry->is_dirty = true;
+		if (entry->is_accessed &&
+			(access_type != AccessType::STORE || entry->is_dirty))
+		{
+			break;
 		}
 
-		bus->store(entry->pte_addr, entry->pte, 64);
+		if (set_accessed(*entry, access_type))
+			break;
+
+		// The PTE changed since it was cached, walk it again
+		entry->generation = 0;
 	}
 
-	return entry->phys_base | (addr & 0xfffULL);
+	if (entry->host)
+		host = entry->host + (addr & ~entry->page_mask);
+
+	return entry->phys_base | (addr & ~entry->page_mask);
 }
 
 namespace Emulator {
-	std::unique_ptr<Mmu> mmu;
+	thread_local Mmu *mmu = nullptr;
 };
@@ -1,8 +1,47 @@
 #include <exception>
+#include <bit>
 #include "plic.hpp"
+#include "bus.hpp"
 
 using namespace Emulator;
 
+uint64_t Plic::best(uint64_t ctx) const
+{
+	uint64_t irq = 0;
+	uint32_t level = treshold[ctx];
+
+	for (uint64_t idx = 0; idx < pending.size(); idx++) {
+		uint32_t bits = pending[idx] & enable[ctx * 32 + idx];
+
+		while (bits) {
+			uint64_t candidate = idx * 32 + std::countr_zero(bits);
+			bits &= bits - 1;
+
+			if (priority[candidate] > level) {
+				level = priority[candidate];
+				irq = candidate;
+			}
+		}
+	}
+
+	return irq;
+}
+
+void Plic::update(void)
+{
+	uint64_t mask = 0;
+
+	for (uint64_t ctx = 0; ctx < Context::SIZE; ctx++)
+		if (best(ctx))
+			mask |= 1ULL << ctx;
+
+	uint64_t rising = mask & ~raised.exchange(mask, std::memory_order_relaxed);
+
+	for (uint64_t ctx = 0; ctx < Context::SIZE; ctx++)
+		if ((rising >> ctx) & 1)
+			bus->wakeups.wake(ctx / 2);
+}
+
 uint64_t Plic::load(uint64_t addr, uint64_t len)
 {
 	if (addr >= PRIORITY_BASE &&
@@ -28,8 +67,13 @@ uint64_t Plic::load(uint64_t addr, uint64_t len)
 
 		if (off == 0)
 			return treshold[ctx];
-		else if (off == 4)
-			return claim[ctx];
+		else if (off == 4) {
+			uint64_t irq = best(ctx);
+			if (irq)
+				clear_pending(irq);
+
+			return irq;
+		}
 	}
 
 	return 0;
@@ -41,16 +85,19 @@ void Plic::store(uint64_t addr, uint64_t value, uint64_t len)
 		addr <= PRIORITY_BASE + PRIORITY_SIZE)
 	{
 		priority[(addr - PRIORITY_BASE) / 4] = value;
+		update();
 	}
 	else if (addr >= PENDING_BASE &&
 		addr <= PENDING_BASE + PENDING_SIZE)
 	{
 		pending[(addr - PENDING_BASE) / 4] = value;
+		update();
 	}
 	else if (addr >= ENABLE_BASE &&
 		addr <= ENABLE_BASE + ENABLE_SIZE)
 	{
 		enable[(addr - ENABLE_BASE) / 4] = value;
+		update();
 	}
 	else if (addr >= TRESHOLD_CLAIM_BASE &&
 		addr <= TRESHOLD_CLAIM_BASE + TRESHOLD_CLAIM_SIZE)
@@ -58,10 +105,10 @@ void Plic::store(uint64_t addr, uint64_t value, uint64_t len)
 		uint64_t ctx = (addr - TRESHOLD_CLAIM_BASE) / 0x1000ULL;
 		uint64_t off = addr - (TRESHOLD_CLAIM_BASE + 0x1000ULL * ctx);
 
-		if (off == 0)
+		if (off == 0) {
 			treshold[ctx] = value;
-		else if (off == 4)
-			clear_pending(value);
+			update();
+		}
 	}
 }
 
@@ -0,0 +1,21 @@
+#include "scheduler.hpp"
+#include "bus.hpp"
+
+using namespace Emulator;
+
+void Scheduler::run(void)
+{
+	next = NEVER;
+
+	for (size_t i = 0; i < deadlines.size(); i++) {
+		if (deadlines[i] > now)
+			continue;
+
+		deadlines[i] = NEVER;
+
+		bus->tick(static_cast<DeviceName>(i));
+	}
+
+	for (uint64_t deadline : deadlines)
+		next = std::min(next, deadline);
+}
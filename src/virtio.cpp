@@ -1,23 +1,192 @@
+#include <algorithm>
+#include <climits>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 #include "virtio.hpp"
 #include "errors.hpp"
 #include "bus.hpp"
+#include "plic.hpp"
 
 using namespace Emulator;
 
-Virtio::Virtio(std::vector<uint8_t> data) :
+// Disk file backend, positioned reads and writes
+// are only ever issued from the worker thread
+#ifdef _WIN32
+static int open_disk(const std::string& path, bool read_only)
+{
+	return _open(
+		path.c_str(),
+		(read_only ? _O_RDONLY : _O_RDWR) | _O_BINARY | _O_NOINHERIT
+	);
+}
+
+static bool stat_disk(int fd, uint64_t& size)
+{
+	struct _stati64 st;
+	if (_fstati64(fd, &st))
+		return false;
+
+	size = st.st_size;
+	return true;
+}
+
+static bool pread_all(int fd, uint8_t *dst, uint64_t len, uint64_t off)
+{
+	if (_lseeki64(fd, off, SEEK_SET) < 0)
+		return false;
+
+	for (uint64_t done = 0; done < len;) {
+		int count = _read(fd, dst + done, std::min<uint64_t>(len - done, INT_MAX));
+
+		if (count <= 0)
+			return false;
+
+		done += count;
+	}
+
+	return true;
+}
+
+static bool pwrite_all(int fd, const uint8_t *src, uint64_t len, uint64_t off)
+{
+	if (_lseeki64(fd, off, SEEK_SET) < 0)
+		return false;
+
+	for (uint64_t done = 0; done < len;) {
+		int count = _write(fd, src + done, std::min<uint64_t>(len - done, INT_MAX));
+
+		if (count <= 0)
+			return false;
+
+		done += count;
+	}
+
+	return true;
+}
+
+static bool sync_disk(int fd)
+{
+	return !_commit(fd);
+}
+
+static void close_disk(int fd)
+{
+	_close(fd);
+}
+#else
+static int open_disk(const std::string& path, bool read_only)
+{
+	return open(path.c_str(), (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+}
+
+static bool stat_disk(int fd, uint64_t& size)
+{
+	struct stat st;
+	if (fstat(fd, &st))
+		return false;
+
+	size = st.st_size;
+	return true;
+}
+
+static bool pread_all(int fd, uint8_t *dst, uint64_t len, uint64_t off)
+{
+	for (uint64_t done = 0; done < len;) {
+		ssize_t count = pread(fd, dst + done, len - done, off + done);
+
+		if (count <= 0)
+			return false;
+
+		done += count;
+	}
+
+	return true;
+}
+
+static bool pwrite_all(int fd, const uint8_t *src, uint64_t len, uint64_t off)
+{
+	for (uint64_t done = 0; done < len;) {
+		ssize_t count = pwrite(fd, src + done, len - done, off + done);
+
+		if (count <= 0)
+			return false;
+
+		done += count;
+	}
+
+	return true;
+}
+
+static bool sync_disk(int fd)
+{
+	return !fdatasync(fd);
+}
+
+static void close_disk(int fd)
+{
+	close(fd);
+}
+#endif
+
+Virtio::Virtio(const std::string& path, bool _read_only) :
 	Device(VIRTIO_BASE, VIRTIO_SIZE),
-	rfsimg(std::move(data))
+	read_only(_read_only)
 {
+	fd = open_disk(path, read_only);
+	if (fd < 0)
+		error<FAIL>("could not open virtual drive ", path, "\n");
+
+	if (!stat_disk(fd, disk_size)) {
+		close_disk(fd);
+		error<FAIL>("could not stat virtual drive ", path, "\n");
+	}
+
 	queue_notify = QUEUE_NOTIFY_RESET;
 
 	vq.align = VQUEUE_ALIGN;
 
-	config[1] = 0x20;
-	config[2] = 0x03;
+	// Capacity in sectors, little endian
+	uint64_t capacity = disk_size / SECTOR_SIZE;
+
+	for (uint64_t i = 0; i < 8; i++)
+		config[i] = capacity >> (i * 8);
 
+	host_feat[0] = 1 << BLK_F_FLUSH;
 	host_feat[1] = 1 << 3;
 
+	if (read_only)
+		host_feat[0] |= 1 << BLK_F_RO;
+
 	reset();
+
+	worker = std::thread(&Virtio::work, this, bus);
+}
+
+Virtio::~Virtio()
+{
+	stop();
+
+	if (fd >= 0)
+		close_disk(fd);
+}
+
+void Virtio::stop(void)
+{
+	if (!worker.joinable())
+		return;
+
+	{
+		std::scoped_lock guard(worker_lock);
+		stopping = true;
+	}
+
+	worker_cond.notify_one();
+	worker.join();
 }
 
 void Virtio::update(void)
@@ -34,64 +203,185 @@ void Virtio::update(void)
 
 Virtio::VirtqDesc Virtio::load_desc(uint64_t addr)
 {
-	return {	
-		.addr = static_cast<uint64_t>(
-			bus->load(addr, 64)
-		),
-		.len = static_cast<uint32_t>(
-			bus->load(addr + 8, 32)
-		),
-		.flags = static_cast<uint16_t>(
-			bus->load(addr + 12, 16)
-		),
-		.next = static_cast<uint16_t>(
-			bus->load(addr + 14, 16)
-		)
-	};
+	VirtqDesc desc = {0};
+
+	bus->read_span(addr, &desc, sizeof(desc));
+
+	return desc;
+}
+
+uint8_t Virtio::transfer(uint32_t type, uint64_t off, const VirtqDesc& desc)
+{
+	if (type != BLK_T_IN && type != BLK_T_OUT)
+		return BLK_S_UNSUPP;
+
+	if (off > disk_size || desc.len > disk_size - off)
+		return BLK_S_IOERR;
+
+	uint8_t *host = bus->host(desc.addr, desc.len);
+
+	// Straight between the file and guest memory
+	if (host) {
+		if (type == BLK_T_IN) {
+			if (!pread_all(fd, host, desc.len, off))
+				return BLK_S_IOERR;
+
+			bus->invalidate(desc.addr, desc.len);
+		} else if (read_only || !pwrite_all(fd, host, desc.len, off))
+			return BLK_S_IOERR;
+
+		return BLK_S_OK;
+	}
+
+	for (uint64_t done = 0; done < desc.len;) {
+		uint64_t len = std::min<uint64_t>(CHUNK_SIZE, desc.len - done);
+
+		if (type == BLK_T_IN) {
+			if (!pread_all(fd, buffer.data(), len, off + done) ||
+				!bus->write_span(desc.addr + done, buffer.data(), len))
+			{
+				return BLK_S_IOERR;
+			}
+		} else {
+			if (read_only ||
+				!bus->read_span(desc.addr + done, buffer.data(), len) ||
+				!pwrite_all(fd, buffer.data(), len, off + done))
+			{
+				return BLK_S_IOERR;
+			}
+		}
+
+		done += len;
+	}
+
+	return BLK_S_OK;
+}
+
+uint8_t Virtio::request(const Virtq& queue, uint16_t head, uint32_t& written)
+{
+	VirtqDesc desc = load_desc(queue.desc + (sizeof(VirtqDesc) * head));
+	BlkReq req = {0};
+
+	if (!bus->read_span(desc.addr, &req, sizeof(req)))
+		return BLK_S_IOERR;
+
+	uint64_t off = req.sector * SECTOR_SIZE;
+	uint8_t blk_status = BLK_S_OK;
+
+	if (req.sector > disk_size / SECTOR_SIZE)
+		blk_status = BLK_S_IOERR;
+
+	// Data descriptors follow the header, the
+	// last one in the chain takes the status
+	for (uint32_t i = 0; i < queue.num; i++) {
+		desc = load_desc(queue.desc + (sizeof(VirtqDesc) * desc.next));
+
+		if (!(desc.flags & DESC_F_NEXT))
+			break;
+
+		if (blk_status == BLK_S_OK)
+			blk_status = transfer(req.type, off, desc);
+
+		if (req.type == BLK_T_IN)
+			written += desc.len;
+
+		off += desc.len;
+	}
+
+	if (req.type == BLK_T_FLUSH && blk_status == BLK_S_OK && !sync_disk(fd))
+		blk_status = BLK_S_IOERR;
+
+	bus->write_span(desc.addr, &blk_status, 1);
+	written++;
+
+	return blk_status;
 }
 
 void Virtio::access_disk(void)
 {
-	uint16_t idx = bus->load(
-		vq.avail + offsetof(VRingAvail, idx),
-		16
-	);
-	
-	uint16_t desc_off = bus->load(
-		vq.avail + 4 + ((idx & vq.num) * 2),
-		16
-	);
+	for (;;) {
+		Virtq queue;
+		uint16_t next;
+
+		{
+			auto guard = bus->lock();
+			queue = vq;
+			next = last_avail;
+		}
+
+		uint16_t idx;
+		uint16_t head;
+
+		if (!queue.num ||
+			!bus->read_span(queue.avail + offsetof(VRingAvail, idx), &idx, 2) ||
+			idx == next ||
+			!bus->read_span(queue.avail + 4 + ((next % queue.num) * 2), &head, 2))
+		{
+			return;
+		}
+
+		// The host I/O runs without the bus lock,
+		// so the harts keep going in the meantime
+		uint32_t written = 0;
+		request(queue, head, written);
 
-	VirtqDesc desc0 = load_desc(vq.desc + (sizeof(VirtqDesc) * desc_off));
-	VirtqDesc desc1 = load_desc(vq.desc + (sizeof(VirtqDesc) * desc0.next));
-	VirtqDesc desc2 = load_desc(vq.desc + (sizeof(VirtqDesc) * desc1.next));
-
-	uint32_t blk_req_type = bus->load(desc0.addr, 32);
-	uint64_t blk_req_sector = bus->load(desc0.addr + 8, 64);
-
-	if (blk_req_type == BLK_T_OUT)
-		for (uint32_t i = 0; i < desc1.len; i++)
-			rfsimg[blk_req_sector * SECTOR_SIZE + i] = 
-				bus->load(desc1.addr + 1, 8);
-	else
-		for (uint32_t i = 0; i < desc1.len; i++)
-			bus->store(
-				desc1.addr + i,
-				rfsimg[blk_req_sector * SECTOR_SIZE + i],
-				8
-			);
-	
-	bus->store(desc2.addr, BLK_S_OK, 8);
-	bus->store(vq.used + 4 + ((id % vq.num) * 8), desc_off, 16);
-	bus->store(vq.used + 2, ++id, 16);
+		auto guard = bus->lock();
+
+		// Dropped by a device reset while in flight
+		if (last_avail != next)
+			continue;
+
+		VRingUsedElem elem = {head, written};
+
+		last_avail++;
+		bus->write_span(queue.used + 4 + ((id % queue.num) * 8), &elem, sizeof(elem));
+		id++;
+		bus->write_span(queue.used + 2, &id, 2);
+
+		isr |= 0x1;
+
+		Plic *plic = static_cast<Plic*>(
+			bus->get(DeviceName::PLIC)
+		);
+		if (plic)
+			plic->update_pending(VIRTIO_IRQN);
+	}
+}
+
+void Virtio::work(Bus *owner)
+{
+	bus = owner;
+
+	for (;;) {
+		{
+			std::unique_lock guard(worker_lock);
+
+			worker_cond.wait(guard, [this] {
+				return notified || stopping;
+			});
+
+			if (stopping)
+				return;
+
+			notified = false;
+		}
+
+		access_disk();
+	}
 }
 
 uint64_t Virtio::load(uint64_t addr, uint64_t len)
 {
 	addr -= base;
 
-	if (addr >= CONFIG)
-		return config[addr - CONFIG];
+	if (addr >= CONFIG) {
+		uint64_t value = 0;
+
+		for (uint64_t i = 0; i < len / 8 && addr - CONFIG + i < config.size(); i++)
+			value |= static_cast<uint64_t>(config[addr - CONFIG + i]) << (i * 8);
+
+		return value;
+	}
 
 	switch (addr) {
 	case MAGIC_VALUE: 		return MAGIC;
@@ -111,11 +401,9 @@ void Virtio::store(uint64_t addr, uint64_t value, uint64_t len)
 {
 	addr -= base;
 
-	if (addr >= CONFIG) {
-		uint64_t idx = addr - CONFIG;
-		config[idx] = (value >> (idx * 8)) & 0xFF;
+	// Capacity is the only config field and it is read-only
+	if (addr >= CONFIG)
 		return;
-	}
 
 	switch (addr) {
 	case DEVICE_FEAT_SEL:
@@ -142,10 +430,16 @@ void Virtio::store(uint64_t addr, uint64_t value, uint64_t len)
 		break;
 	case QUEUE_NOTIFY:
 		queue_notify = value;
-		notify_clock = clock;
+
+		{
+			std::scoped_lock guard(worker_lock);
+			notified = true;
+		}
+
+		worker_cond.notify_one();
 		break;
 	case INTERRUPT_ACK:
-		isr = ~value;
+		isr &= ~value;
 		break;
 	case STATUS:
 		status = value & 0xFF;
@@ -169,21 +463,7 @@ void Virtio::dump(void) const
 		"\n# base: ", base,
 		"\n# size: ", size,
 		"\n# status: ", status,
+		"\n# disk size: ", disk_size,
 		"\n################################\n"
 	);
 }
-
-void Virtio::tick(void)
-{
-	if (queue_notify != QUEUE_NOTIFY_RESET &&
-		clock == notify_clock + DISK_DELAY)
-	{
-		isr |= 0x1;
-
-		access_disk();
-
-		queue_notify = QUEUE_NOTIFY_RESET;
-	}
-
-	++clock;
-}
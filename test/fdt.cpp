@@ -0,0 +1,147 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include "common.hpp"
+#include "errors.hpp"
+#include "fdt.hpp"
+
+using namespace Emulator;
+
+static bool same(const Fdt::Node& lhs, const Fdt::Node& rhs)
+{
+	if (lhs.name != rhs.name ||
+		lhs.props.size() != rhs.props.size() ||
+		lhs.children.size() != rhs.children.size())
+	{
+		return false;
+	}
+
+	for (uint64_t i = 0; i < lhs.props.size(); i++)
+		if (lhs.props[i].name != rhs.props[i].name ||
+			lhs.props[i].value != rhs.props[i].value)
+		{
+			return false;
+		}
+
+	for (uint64_t i = 0; i < lhs.children.size(); i++)
+		if (!same(lhs.children[i], rhs.children[i]))
+			return false;
+
+	return true;
+}
+
+static Fdt sample(void)
+{
+	Fdt fdt;
+
+	fdt.root.set("#address-cells", {2});
+	fdt.root.set("#size-cells", {2});
+	fdt.root.props.push_back({"compatible", {'r', 'v', '6', '4', 0}});
+
+	fdt.root.children.push_back({"memory@80000000", {}, {}});
+	fdt.root.children.back().set("reg", {0, 0x80000000, 0x10, 0});
+
+	fdt.root.children.push_back({"cpus", {}, {}});
+	fdt.root.children.back().set("#address-cells", {1});
+	fdt.root.children.back().children.push_back({"cpu@0", {}, {}});
+	fdt.root.children.back().children.back().set("reg", {0});
+
+	// Empty property, only the name is stored
+	fdt.root.children.back().children.back().props.push_back({"dma-coherent", {}});
+
+	return fdt;
+}
+
+static bool test_round_trip(void)
+{
+	Fdt fdt = sample();
+	std::vector<uint8_t> blob = fdt.save();
+
+	Fdt loaded;
+	if (!loaded.load(blob) || !same(fdt.root, loaded.root))
+		return false;
+
+	// Saving what was loaded gives back the same blob
+	return loaded.save() == blob;
+}
+
+static uint32_t header(const std::vector<uint8_t>& blob, uint64_t off)
+{
+	return (blob[off] << 24) | (blob[off + 1] << 16) |
+		(blob[off + 2] << 8) | blob[off + 3];
+}
+
+static bool test_truncated(void)
+{
+	std::vector<uint8_t> blob = sample().save();
+
+	// The strings block ends the data, only alignment follows it
+	uint64_t end = header(blob, 12) + header(blob, 32);
+
+	for (uint64_t len = 0; len < end; len++) {
+		std::vector<uint8_t> cut(blob.begin(), blob.begin() + len);
+		Fdt fdt;
+
+		if (fdt.load(cut))
+			return false;
+
+		// Same, with totalsize lying about the cut
+		if (len >= 8) {
+			cut[4] = len >> 24;
+			cut[5] = len >> 16;
+			cut[6] = len >> 8;
+			cut[7] = len;
+
+			if (fdt.load(cut))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static bool test_short_cell(void)
+{
+	uint32_t cell = 0;
+
+	return !Fdt::cell({}, 0, cell) &&
+		!Fdt::cell({0, 0, 1}, 0, cell) &&
+		!Fdt::cell({0, 0, 0, 1}, 1, cell) &&
+		Fdt::cell({0, 0, 0, 1}, 0, cell) && cell == 1;
+}
+
+static bool test_dtb(void)
+{
+	std::vector<uint8_t> blob = load_file("test/linux/dtb.dtb");
+	Fdt fdt;
+
+	if (!fdt.load(blob))
+		return false;
+
+	std::vector<uint8_t> saved = fdt.save();
+	Fdt loaded;
+
+	return loaded.load(saved) && same(fdt.root, loaded.root) &&
+		loaded.save() == saved;
+}
+
+int main(void)
+{
+	static constexpr std::pair<const char*, bool (*)(void)> tests[] = {
+		{"round trip", test_round_trip},
+		{"truncated blob", test_truncated},
+		{"short cell", test_short_cell},
+		{"test/linux/dtb.dtb", test_dtb}
+	};
+
+	for (const auto& [name, test] : tests) {
+		if (test())
+			std::cout << GREEN << "[PASS] " << CLEAR;
+		else
+			std::cout << RED << "[FAIL] " << CLEAR;
+
+		std::cout << "fdt: " << name << '\n';
+	}
+
+	return 0;
+}
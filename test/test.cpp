@@ -15,6 +15,7 @@
 #include "syscon.hpp"
 #include "virtio.hpp"
 #include "emulator.hpp"
+#include "machine.hpp"
 
 using namespace Emulator;
 
@@ -61,9 +62,7 @@ namespace fs = std::filesystem;
 
 static bool test_bin(const fs::directory_entry& bin_path)
 {
-	cpu = std::make_unique<Cpu>();
-	mmu = std::make_unique<Mmu>();
-	bus = std::make_unique<Bus>();
+	Machine machine;
 
 	cpu->int_regs[IRegs::sp] = RAM_OFF + BYTE_SIZE<KIB>(64);
 